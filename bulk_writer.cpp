@@ -0,0 +1,108 @@
+#include <iostream>
+#include <cstring>
+#include "bulk_writer.h"
+
+bulk_writer::bulk_writer(const table_spec &table, bulk_mode write_mode, size_t max_statement_size) :
+	spec(table), mode(write_mode), max_statement(max_statement_size), first_field(true) {
+	head = std::string(spec.insert) + " INTO " + spec.table + " (" + spec.columns + ")";
+	if(mode == BULK_INSERT) {
+		head += " VALUES ";
+	}
+}
+
+void bulk_writer::begin_row() {
+	row.clear();
+	first_field = true;
+	if(mode == BULK_INSERT) {
+		row += '(';
+	}
+}
+
+void bulk_writer::end_row() {
+	if(mode == BULK_LOAD_DATA) {
+		rows += row;
+		rows += '\n';
+		return;
+	}
+	row += ')';
+	// A single row that is too long still gets a statement of its own
+	if(!rows.empty() && head.size() + rows.size() + 1 + row.size() + 1 + strlen(spec.on_duplicate) > max_statement) {
+		end_statement();
+	}
+	if(!rows.empty()) {
+		rows += ',';
+	}
+	rows += row;
+}
+
+// Strings are escaped the way the server's own escaping does it, for a
+// quoted SQL string or for a LOAD DATA field with the default separators
+void bulk_writer::text(const char *data, size_t length) {
+	separate();
+	if(mode == BULK_INSERT) {
+		row += '\'';
+	}
+	for(size_t i = 0; i < length; i++) {
+		char c = data[i];
+		switch(c) {
+			case '\0': row += "\\0"; break;
+			case '\n': row += "\\n"; break;
+			case '\r': row += "\\r"; break;
+			case '\\': row += "\\\\"; break;
+			case '\032': row += "\\Z"; break;
+			case '\t': row += mode == BULK_INSERT ? "\t" : "\\t"; break;
+			case '\'': row += mode == BULK_INSERT ? "\\'" : "'"; break;
+			case '"': row += mode == BULK_INSERT ? "\\\"" : "\""; break;
+			default: row += c;
+		}
+	}
+	if(mode == BULK_INSERT) {
+		row += '\'';
+	}
+}
+
+void bulk_writer::end_statement() {
+	flush_job job;
+	std::string sql = head + rows;
+	if(*spec.on_duplicate) {
+		sql += ' ';
+		sql += spec.on_duplicate;
+	}
+	job.statements.push_back(sql);
+	jobs.push_back(job);
+	rows.clear();
+}
+
+std::vector<flush_job> &bulk_writer::finish() {
+	if(rows.empty()) {
+		return jobs;
+	}
+	if(mode == BULK_INSERT) {
+		end_statement();
+		return jobs;
+	}
+	std::string staging = std::string(spec.table) + "_load";
+	flush_job job;
+	job.infile_into = "INTO TABLE " + staging + " (" + spec.columns + ")";
+	job.infile_data.swap(rows);
+	job.statements.push_back("CREATE TEMPORARY TABLE IF NOT EXISTS " + staging + " (" + spec.staging_columns + ")");
+	job.statements.push_back("TRUNCATE TABLE " + staging);
+	std::string merge = head + " SELECT " + spec.columns + " FROM " + staging;
+	if(*spec.on_duplicate) {
+		merge += ' ';
+		merge += spec.on_duplicate;
+	}
+	job.statements.push_back(merge);
+	jobs.push_back(job);
+	return jobs;
+}
+
+bulk_mode bulk_mode_from_string(const std::string &name) {
+	if(name == "load_data") {
+		return BULK_LOAD_DATA;
+	}
+	if(name != "insert") {
+		std::cout << "Unknown flush mode " << name << ", using insert" << std::endl;
+	}
+	return BULK_INSERT;
+}
@@ -0,0 +1,76 @@
+#ifndef OCELOT_BULK_WRITER_H
+#define OCELOT_BULK_WRITER_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// How flushed rows reach their table, see bulk_writer
+enum bulk_mode { BULK_INSERT, BULK_LOAD_DATA };
+
+// A table rows are flushed to. The staging table used by BULK_LOAD_DATA only
+// has the flushed columns, with the definitions given here. Target columns
+// in on_duplicate must be qualified with the table name, as the staging
+// table has columns of the same names.
+typedef struct {
+	const char *table;
+	const char *columns;
+	const char *staging_columns;
+	const char *insert; // INSERT or INSERT IGNORE
+	const char *on_duplicate; // Clause after the rows, "" for none
+} table_spec;
+
+// Statements a flush_stream runs in order and retries as a whole. If
+// infile_data is set, it's written to a new temporary file and loaded with
+// LOAD DATA LOCAL INFILE '<file>' followed by infile_into, right before the
+// last statement. The file is only named when the job runs.
+typedef struct {
+	std::vector<std::string> statements;
+	std::string infile_into;
+	std::string infile_data;
+} flush_job;
+
+// Turns the rows of one flush into the jobs that write them.
+// BULK_INSERT makes multi-row INSERTs of at most max_statement bytes, each a
+// job of its own so a retry never writes a chunk twice.
+// BULK_LOAD_DATA makes one job that loads all rows into a temporary staging
+// table from a private file in /dev/shm and merges them with a single statement, so
+// the rows are never parsed as SQL and there's no statement size to cap.
+class bulk_writer {
+	private:
+		const table_spec &spec;
+		bulk_mode mode;
+		size_t max_statement;
+		std::string head; // Up to the rows of an INSERT
+		std::string rows; // Rows of the current INSERT, or of the whole infile
+		std::string row; // The row being added
+		bool first_field;
+		std::vector<flush_job> jobs;
+
+		void separate() {
+			if(!first_field) {
+				row += mode == BULK_INSERT ? ',' : '\t';
+			}
+			first_field = false;
+		}
+		void end_statement();
+
+	public:
+		bulk_writer(const table_spec &table, bulk_mode write_mode, size_t max_statement_size);
+
+		void begin_row();
+		void end_row();
+		template<class T> void number(T value) {
+			separate();
+			row += std::to_string(value);
+		}
+		void text(const char *data, size_t length);
+		void text(const std::string &value) { text(value.data(), value.size()); }
+
+		// The jobs for every row added, there are none if no rows were
+		std::vector<flush_job> &finish();
+};
+
+bulk_mode bulk_mode_from_string(const std::string &name);
+
+#endif
@@ -13,11 +13,12 @@ class config {
 		unsigned int timeout_interval;
 		unsigned int schedule_interval;
 		unsigned int max_middlemen;
+		unsigned int io_threads;
+		unsigned int worker_threads;
 		
 		unsigned int announce_interval;
 		int peers_timeout;
 		
-		unsigned int reap_peers_interval;
                 unsigned int keep_speed;
 		
 		// MySQL
@@ -25,6 +26,10 @@ class config {
 		std::string mysql_host;
 		std::string mysql_username;
 		std::string mysql_password;
+		std::string flush_mode;
+		unsigned int max_statement_size;
+		std::string journal_dir;
+		unsigned int flush_memory_budget;
 		
 		std::string site_password;
 		
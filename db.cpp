@@ -2,8 +2,12 @@
 #include "db.h"
 #include "misc_functions.h"
 #include <string>
+#include <cstring>
 #include <iostream>
+#include <cstdlib>
+#include <cerrno>
 #include <queue>
+#include <sstream>
 #include <unistd.h>
 #include <time.h>
 #include <boost/thread/thread.hpp>
@@ -13,14 +17,115 @@
 
 #define DB_LOCK_TIMEOUT 50
 
-mysql::mysql(std::string mysql_db, std::string mysql_host, std::string username, std::string password) {
+// all_rings owns the rings, so they aren't freed when their thread exits
+// before the flush has drained them
+static void keep_rings(record_rings *) {}
+
+// The tables written by the flush
+static const table_spec users_table = {
+	"users_main",
+	"ID,Uploaded,Downloaded,UploadedDaily,DownloadedDaily",
+	"ID int unsigned NOT NULL, Uploaded bigint NOT NULL, Downloaded bigint NOT NULL, "
+		"UploadedDaily bigint NOT NULL, DownloadedDaily bigint NOT NULL",
+	"INSERT",
+	"ON DUPLICATE KEY UPDATE users_main.Uploaded = users_main.Uploaded + VALUES(Uploaded), "
+		"users_main.Downloaded = users_main.Downloaded + VALUES(Downloaded), "
+		"users_main.UploadedDaily = users_main.UploadedDaily + VALUES(UploadedDaily), "
+		"users_main.DownloadedDaily = users_main.DownloadedDaily + VALUES(DownloadedDaily)"
+};
+
+static const table_spec torrents_table = {
+	"torrents",
+	"ID,Seeders,Leechers,Snatched,Balance",
+	"ID int unsigned NOT NULL, Seeders int NOT NULL, Leechers int NOT NULL, Snatched int NOT NULL, Balance bigint NOT NULL",
+	"INSERT",
+	"ON DUPLICATE KEY UPDATE torrents.Seeders = VALUES(Seeders), torrents.Leechers = VALUES(Leechers), "
+		"torrents.Snatched = torrents.Snatched + VALUES(Snatched), torrents.Balance = VALUES(Balance), "
+		"torrents.last_action = IF(VALUES(Seeders) > 0, NOW(), torrents.last_action)"
+};
+
+static const table_spec snatches_table = {
+	"xbt_snatched",
+	"uid,fid,tstamp,IP",
+	"uid int NOT NULL, fid int NOT NULL, tstamp int NOT NULL, IP varchar(15) NOT NULL",
+	"INSERT",
+	""
+};
+
+static const table_spec peers_table = {
+	"xbt_files_users",
+	"uid,fid,active,uploaded,downloaded,upspeed,downspeed,remaining,timespent,announced,ip,port,peer_id,useragent,mtime",
+	"uid int NOT NULL, fid int NOT NULL, active tinyint NOT NULL, uploaded bigint NOT NULL, downloaded bigint NOT NULL, "
+		"upspeed bigint NOT NULL, downspeed bigint NOT NULL, remaining bigint unsigned NOT NULL, timespent int NOT NULL, "
+		"announced int NOT NULL, ip varchar(15) NOT NULL, port int NOT NULL, peer_id binary(20) NOT NULL, "
+		"useragent varchar(255) NOT NULL, mtime int NOT NULL",
+	"INSERT",
+	"ON DUPLICATE KEY UPDATE xbt_files_users.active = VALUES(active), xbt_files_users.uploaded = VALUES(uploaded), "
+		"xbt_files_users.downloaded = VALUES(downloaded), xbt_files_users.upspeed = VALUES(upspeed), "
+		"xbt_files_users.downspeed = VALUES(downspeed), xbt_files_users.remaining = VALUES(remaining), "
+		"xbt_files_users.timespent = VALUES(timespent), xbt_files_users.announced = VALUES(announced), "
+		"xbt_files_users.mtime = VALUES(mtime), xbt_files_users.port = VALUES(port)"
+};
+
+static const table_spec peer_hist_table = {
+	"xbt_peers_history",
+	"uid,downloaded,remaining,uploaded,upspeed,downspeed,timespent,peer_id,ip,fid,mtime",
+	"uid int NOT NULL, downloaded bigint NOT NULL, remaining bigint unsigned NOT NULL, uploaded bigint NOT NULL, "
+		"upspeed bigint NOT NULL, downspeed bigint NOT NULL, timespent int NOT NULL, peer_id binary(20) NOT NULL, "
+		"ip varchar(15) NOT NULL, fid int NOT NULL, mtime int NOT NULL",
+	"INSERT IGNORE",
+	""
+};
+
+static const table_spec tokens_table = {
+	"users_freeleeches",
+	"UserID,TorrentID,Downloaded,Uploaded",
+	"UserID int NOT NULL, TorrentID int NOT NULL, Downloaded bigint NOT NULL, Uploaded bigint NOT NULL",
+	"INSERT",
+	"ON DUPLICATE KEY UPDATE users_freeleeches.Downloaded = users_freeleeches.Downloaded + VALUES(Downloaded), "
+		"users_freeleeches.Uploaded = users_freeleeches.Uploaded + VALUES(Uploaded)"
+};
+
+mysql::mysql(std::string mysql_db, std::string mysql_host, std::string username, std::string password,
+	const std::string &flush_mode, size_t max_statement_size) :
+	local_rings(keep_rings),
+	torrent_cleanup(false),
+	user_stream("Users", mysql_db, mysql_host, username, password),
+	torrent_stream("Torrents", mysql_db, mysql_host, username, password),
+	peer_stream("Peers", mysql_db, mysql_host, username, password),
+	snatch_stream("Snatches", mysql_db, mysql_host, username, password),
+	token_stream("Tokens", mysql_db, mysql_host, username, password),
+	peer_hist_stream("Peer history", mysql_db, mysql_host, username, password),
+	bulk(bulk_mode_from_string(flush_mode)),
+	max_statement(max_statement_size),
+	user_agents(USER_AGENT_LIMIT, USER_AGENT_LENGTH, USER_AGENTS_PER_USER, "Other"),
+	flush_requested(false),
+	flush_closing(false),
+	cleared(false) {
+	// The peer tables are too busy to replicate
+	peer_stream.add_session_sql("SET session sql_log_bin = 0");
+	peer_hist_stream.add_session_sql("SET session sql_log_bin = 0");
+	if(bulk == BULK_LOAD_DATA) {
+		user_stream.allow_local_infile();
+		torrent_stream.allow_local_infile();
+		peer_stream.allow_local_infile();
+		snatch_stream.allow_local_infile();
+		token_stream.allow_local_infile();
+		peer_hist_stream.allow_local_infile();
+	}
+	user_stream.start();
+	torrent_stream.start();
+	peer_stream.start();
+	snatch_stream.start();
+	token_stream.start();
+	peer_hist_stream.start();
+	boost::thread flush_thread(&mysql::run_flush, this);
+	
         if(!conn.connect(mysql_db.c_str(), mysql_host.c_str(), username.c_str(), password.c_str(), 0)) {
                 std::cout << "Could not connect to MySQL" << std::endl;
                 return;
         }
 
-	db = mysql_db, server = mysql_host, db_user = username, pw = password;
-	u_active = false; t_active = false; p_active = false; s_active = false; tok_active = false; hist_active = false;
 		/*
 		time_t now;
 		time(&now);
@@ -36,11 +141,6 @@ mysql::mysql(std::string mysql_db, std::string mysql_host, std::string username,
 
 		strftime (buffer,80,"%Y-%m-%d %X Connected to MySQL",timeinfo);
 		std::cout << buffer << std::endl;
-		
-		update_user_buffer = "";
-        update_torrent_buffer = "";
-        update_peer_buffer = "";
-        update_snatch_buffer = "";
 
 
         logger_ptr = logger::get_instance();
@@ -57,15 +157,21 @@ void mysql::load_site_options(site_options_t &site_options) {
         }
 }
 
-void mysql::load_torrents(std::unordered_map<std::string, torrent> &torrents) {
+void mysql::load_torrents(torrent_store &torrents) {
         mysqlpp::Query query = conn.query("SELECT ID, info_hash, freetorrent, double_seed, Snatched FROM torrents ORDER BY ID;");
         if(mysqlpp::StoreQueryResult res = query.store()) {
                 mysqlpp::String one("1"); // Hack to get around bug in mysql++3.0.0
                 mysqlpp::String two("2");
                 size_t num_rows = res.num_rows();
+                torrents.reserve(num_rows);
                 for(size_t i = 0; i < num_rows; i++) {
-                        std::string info_hash;
-                        res[i][1].to_string(info_hash);
+                        std::string info_hash_str;
+                        res[i][1].to_string(info_hash_str);
+                        if(info_hash_str.length() != 20) {
+                                continue;
+                        }
+                        infohash_t info_hash;
+                        memcpy(info_hash.data(), info_hash_str.data(), 20);
 
                         torrent t;
                         t.id = res[i][0];
@@ -84,19 +190,26 @@ void mysql::load_torrents(std::unordered_map<std::string, torrent> &torrents) {
 
                         t.balance = 0;
                         t.completed = res[i][4];
-                        t.last_selected_seeder = "";
-                        torrents[info_hash] = t;
+                        t.dirty = false;
+                        t.pending_snatches = 0;
+                        torrents.shard_for(info_hash).torrents[info_hash] = std::move(t);
                 }
         }
 }
 
-void mysql::load_users(std::unordered_map<std::string, user> &users) {
+void mysql::load_users(user_list &users) {
         mysqlpp::Query query = conn.query("SELECT ID, can_leech, torrent_pass, personal_freeleech, PermissionID FROM users_main WHERE Enabled='1';");
         if(mysqlpp::StoreQueryResult res = query.store()) {
                 size_t num_rows = res.num_rows();
+                users.reserve(num_rows);
                 for(size_t i = 0; i < num_rows; i++) {
-                        std::string passkey;
-                        res[i][2].to_string(passkey);
+                        std::string passkey_str;
+                        res[i][2].to_string(passkey_str);
+                        passkey_t passkey;
+                        if(!hex_to_bin(passkey_str, passkey.data(), passkey.size())) {
+                                std::cout << "Skipping user " << res[i][0].c_str() << " with malformed passkey" << std::endl;
+                                continue;
+                        }
 
                         user u;
                         u.id = res[i][0];
@@ -109,15 +222,21 @@ void mysql::load_users(std::unordered_map<std::string, user> &users) {
         }
 }
 
-void mysql::load_tokens(std::unordered_map<std::string, torrent> &torrents) {
+void mysql::load_tokens(torrent_store &torrents) {
         mysqlpp::Query query = conn.query("SELECT us.UserID, us.FreeLeech, us.DoubleSeed, t.info_hash FROM users_slots AS us JOIN torrents AS t ON t.ID = us.TorrentID;");
         if (mysqlpp::StoreQueryResult res = query.store()) {
                 size_t num_rows = res.num_rows();
                 for (size_t i = 0; i < num_rows; i++) {
-                        std::string info_hash;
-                        res[i][3].to_string(info_hash);
-                        std::unordered_map<std::string, torrent>::iterator it = torrents.find(info_hash);
-                        if (it != torrents.end()) {
+                        std::string info_hash_str;
+                        res[i][3].to_string(info_hash_str);
+                        if(info_hash_str.length() != 20) {
+                                continue;
+                        }
+                        infohash_t info_hash;
+                        memcpy(info_hash.data(), info_hash_str.data(), 20);
+                        torrent_list &shard_torrents = torrents.shard_for(info_hash).torrents;
+                        torrent_list::iterator it = shard_torrents.find(info_hash);
+                        if (it != shard_torrents.end()) {
                                 mysqlpp::DateTime fl = res[i][1]; 
                                 mysqlpp::DateTime ds = res[i][2];
                                 slots_t slots;
@@ -125,7 +244,10 @@ void mysql::load_tokens(std::unordered_map<std::string, torrent> &torrents) {
                                 slots.double_seed = ds;
                                 
                                 torrent &tor = it->second;
-                                tor.tokened_users.insert(std::pair<int, slots_t>(res[i][0], slots));
+                                if(!tor.tokened_users) {
+                                        tor.tokened_users.reset(new token_map);
+                                }
+                                tor.tokened_users->insert(std::pair<int, slots_t>(res[i][0], slots));
                         }
                 }
         }
@@ -142,370 +264,601 @@ void mysql::load_blacklist(std::vector<std::string> &blacklist) {
         }
 }
 
-void mysql::record_token(std::string &record) {
-        boost::mutex::scoped_lock lock(user_token_lock);
-        if (update_token_buffer != "") {
-                update_token_buffer += ",";
-        }
-        update_token_buffer += record;
+// The rings of the calling thread, made the first time it records anything
+record_rings &mysql::rings() {
+	record_rings *r = local_rings.get();
+	if(r == NULL) {
+		r = new record_rings(RECORD_RING_SIZE);
+		local_rings.reset(r);
+		boost::mutex::scoped_lock lock(rings_lock);
+		all_rings.push_back(std::unique_ptr<record_rings>(r));
+	}
+	return *r;
 }
 
-void mysql::record_user(std::string &record) {
-        boost::mutex::scoped_lock lock(user_buffer_lock);
-        if(update_user_buffer != "") {
-                update_user_buffer += ",";
-        }
-        update_user_buffer += record;
+void mysql::record_token(int userid, int torrentid, long long downloaded, long long uploaded) {
+	token_record record = { userid, torrentid, downloaded, uploaded };
+	rings().tokens.push(record);
 }
-void mysql::record_torrent(std::string &record) {
-        boost::mutex::scoped_lock lock(torrent_buffer_lock);
-        if(update_torrent_buffer != "") {
-                update_torrent_buffer += ",";
-        }
-        update_torrent_buffer += record;
+
+void mysql::record_user(int id, long long uploaded, long long downloaded, long long real_uploaded, long long real_downloaded) {
+	user_record record = { id, uploaded, downloaded, real_uploaded, real_downloaded };
+	rings().users.push(record);
 }
-void mysql::record_peer(std::string &record, std::string &ip, int port, std::string &peer_id, std::string &useragent) {
-	// Added port to this function //Mobbo
-        boost::mutex::scoped_lock lock(peer_buffer_lock);
-        if(update_peer_buffer != "") {
-                update_peer_buffer += ",";
-        }
-        mysqlpp::Query q = conn.query();
-        q << record << mysqlpp::quote << ip << ',' << port << ',' << mysqlpp::quote << peer_id << ',' << mysqlpp::quote << useragent << "," << time(NULL) << ')';
-	// port without qoutes since it is a int in the DB //Mobbo
-        update_peer_buffer += q.str();
+
+void mysql::record_torrent(int id, size_t seeders, size_t leechers, int snatched, long long balance) {
+	torrent_record record = { id, seeders, leechers, snatched, balance };
+	rings().torrents.push(record);
 }
 
-void mysql::record_peer_hist(std::string &record, std::string &peer_id, std::string &ip, int tid){
-	boost::mutex::scoped_lock (peer_hist_buffer_lock);
-	if (update_peer_hist_buffer != "") {
-		update_peer_hist_buffer += ",";
+// Rows written for a torrent that was deleted on the site create an empty
+// one, these are removed after the next torrent flush
+void mysql::clean_torrents() {
+	torrent_cleanup = true;
+}
+
+void mysql::record_peer(const peer_row_key &key, const peer_row &row) {
+	peer_record record = { key, row };
+	rings().peers.push(record);
+}
+
+void mysql::record_peer_hist(const peer_hist_record &record) {
+	rings().peer_hist.push(record);
+}
+
+void mysql::record_snatch(int userid, int torrentid, time_t tstamp, uint32_t ip) {
+	snatch_record record = { userid, torrentid, tstamp, ip };
+	rings().snatches.push(record);
+}
+
+// Moves everything recorded since the last flush into the flush's own
+// buffers, adding up the byte counts and keeping the last row of each peer
+void mysql::drain_rings() {
+	std::vector<record_rings *> rings_now;
+	{
+		boost::mutex::scoped_lock lock(rings_lock);
+		for(size_t i = 0; i < all_rings.size(); i++) {
+			rings_now.push_back(all_rings[i].get());
+		}
+	}
+	std::vector<user_record> users;
+	std::vector<token_record> tokens;
+	std::vector<peer_record> peers;
+	for(size_t i = 0; i < rings_now.size(); i++) {
+		record_rings &r = *rings_now[i];
+		r.users.drain(users);
+		r.tokens.drain(tokens);
+		r.peers.drain(peers);
+		r.torrents.drain(torrent_records);
+		r.snatches.drain(snatch_records);
+		r.peer_hist.drain(peer_hist_records);
+	}
+	for(std::vector<user_record>::const_iterator u = users.begin(); u != users.end(); u++) {
+		user_delta &delta = user_deltas[u->id];
+		delta.uploaded += u->uploaded;
+		delta.downloaded += u->downloaded;
+		delta.real_uploaded += u->real_uploaded;
+		delta.real_downloaded += u->real_downloaded;
+	}
+	for(std::vector<token_record>::const_iterator t = tokens.begin(); t != tokens.end(); t++) {
+		uint64_t key = (static_cast<uint64_t>(t->userid) << 32) | static_cast<uint32_t>(t->torrentid);
+		token_delta &delta = token_deltas[key];
+		delta.downloaded += t->downloaded;
+		delta.uploaded += t->uploaded;
+	}
+	// A peer that moved to another connection may have its rows drained out
+	// of order, so only the newest one is kept
+	for(std::vector<peer_record>::const_iterator p = peers.begin(); p != peers.end(); p++) {
+		std::pair<peer_row_map::iterator, bool> row = peer_rows.insert(std::make_pair(p->key, p->row));
+		if(!row.second && row.first->second.mtime <= p->row.mtime) {
+			row.first->second = p->row;
+		}
 	}
-	mysqlpp::Query q = conn.query();
-	q << record << ',' << mysqlpp::quote << peer_id << ',' << mysqlpp::quote << ip << ',' << tid << ',' << time(NULL) << ')';
-	update_peer_hist_buffer += q.str();
 }
 
-void mysql::record_snatch(std::string &record) {
-        boost::mutex::scoped_lock lock(mysql::snatch_buffer_lock);
-        if(update_snatch_buffer != "") {
-                update_snatch_buffer += ",";
-        }
-        update_snatch_buffer += record;
+// Only called by the flush thread, after a closing flush
+bool mysql::check_clear() {
+	{
+		boost::mutex::scoped_lock lock(rings_lock);
+		for(size_t i = 0; i < all_rings.size(); i++) {
+			record_rings &r = *all_rings[i];
+			if(!r.users.empty() || !r.tokens.empty() || !r.torrents.empty() || !r.snatches.empty() || !r.peers.empty() || !r.peer_hist.empty()) {
+				return false;
+			}
+		}
+	}
+	if (!user_deltas.empty() || !token_deltas.empty() || !torrent_records.empty() || !peer_rows.empty()
+		|| !snatch_records.empty() || !peer_hist_records.empty()) {
+		return false;
+	}
+	// Every stream is asked, so they all stop at once
+	bool clear = user_stream.stop();
+	clear = torrent_stream.stop() && clear;
+	clear = peer_stream.stop() && clear;
+	clear = snatch_stream.stop() && clear;
+	clear = token_stream.stop() && clear;
+	clear = peer_hist_stream.stop() && clear;
+	return clear;
+}
+
+// Jobs left in the journals are queued again, ahead of anything new
+void mysql::open_journals(const std::string &dir, size_t max_memory) {
+	user_stream.open_journal(dir, "users", max_memory);
+	torrent_stream.open_journal(dir, "torrents", max_memory);
+	peer_stream.open_journal(dir, "peers", max_memory);
+	snatch_stream.open_journal(dir, "snatches", max_memory);
+	token_stream.open_journal(dir, "tokens", max_memory);
+	peer_hist_stream.open_journal(dir, "peer_history", max_memory);
+}
+
+// Wakes the flush thread. Requests made while it's busy are folded into
+// one flush after the current one.
+void mysql::request_flush(bool closing) {
+	boost::mutex::scoped_lock l(flush_lock);
+	flush_requested = true;
+	flush_closing = flush_closing || closing;
+	flush_wanted.notify_one();
 }
 
-bool mysql::all_clear() {
-	return (user_queue.size() == 0 && torrent_queue.size() == 0 && peer_queue.size() == 0 && snatch_queue.size() == 0 && token_queue.size() == 0 && peer_hist_queue.size() == 0);
+void mysql::run_flush() {
+	for(;;) {
+		bool closing;
+		{
+			boost::mutex::scoped_lock l(flush_lock);
+			while(!flush_requested) {
+				flush_wanted.wait(l);
+			}
+			flush_requested = false;
+			closing = flush_closing;
+		}
+		flush(closing);
+		if(closing && check_clear()) {
+			cleared = true;
+		}
+	}
 }
 
-void mysql::flush() {
+// Only called by the flush thread, which makes it the one reader of the rings
+// and the only user of the buffers they are drained into. Everything it queues
+// is synced to the journals once at the end.
+void mysql::flush(bool closing) {
+	drain_rings();
 	flush_users();
 	flush_torrents();
 	flush_snatches();
-	flush_peers();
+	flush_peers(closing);
 	flush_peer_hist();
 	flush_tokens();
+	user_stream.sync();
+	torrent_stream.sync();
+	peer_stream.sync();
+	snatch_stream.sync();
+	token_stream.sync();
+	peer_hist_stream.sync();
 }
 
 void mysql::flush_users() {
-	std::string sql;
-	boost::mutex::scoped_lock lock(user_buffer_lock);
-	if (update_user_buffer == "") {
+	if (user_deltas.empty()) {
 		return;
 	}
-	sql = "INSERT INTO users_main (ID, Uploaded, Downloaded, UploadedDaily, DownloadedDaily) VALUES " + update_user_buffer +
-		" ON DUPLICATE KEY UPDATE Uploaded = Uploaded + VALUES(Uploaded), Downloaded = Downloaded + VALUES(Downloaded), " +
-		"UploadedDaily = UploadedDaily + VALUES(UploadedDaily), DownloadedDaily = DownloadedDaily + VALUES(DownloadedDaily)";
-	user_queue.push(sql);
-	update_user_buffer.clear();
-	if (user_queue.size() == 1 && u_active == false) {
-		boost::thread thread(&mysql::do_flush_users, this);
+	bulk_writer writer(users_table, bulk, max_statement);
+	for (std::unordered_map<int, user_delta>::const_iterator i = user_deltas.begin(); i != user_deltas.end(); i++) {
+		writer.begin_row();
+		writer.number(i->first);
+		writer.number(i->second.uploaded);
+		writer.number(i->second.downloaded);
+		writer.number(i->second.real_uploaded);
+		writer.number(i->second.real_downloaded);
+		writer.end_row();
 	}
+	user_deltas.clear();
+	user_stream.push(writer.finish());
 }
 
 void mysql::flush_torrents() {
-	std::string sql;
-	boost::mutex::scoped_lock lock(torrent_buffer_lock);
-	if (update_torrent_buffer == "") {
+	if (torrent_records.empty()) {
 		return;
 	}
-	sql = "INSERT INTO torrents (ID,Seeders,Leechers,Snatched,Balance) VALUES " + update_torrent_buffer +
-		" ON DUPLICATE KEY UPDATE Seeders=VALUES(Seeders), Leechers=VALUES(Leechers), " +
-		"Snatched=Snatched+VALUES(Snatched), Balance=VALUES(Balance), last_action = " +
-		"IF(VALUES(Seeders) > 0, NOW(), last_action)";
-	torrent_queue.push(sql);
-	update_torrent_buffer.clear();
-	sql.clear();
-	sql = "DELETE FROM torrents WHERE info_hash = ''";
-	torrent_queue.push(sql);
-	if (torrent_queue.size() == 2 && t_active == false) {
-		boost::thread thread(&mysql::do_flush_torrents, this);
+	bulk_writer writer(torrents_table, bulk, max_statement);
+	for (std::vector<torrent_record>::const_iterator t = torrent_records.begin(); t != torrent_records.end(); t++) {
+		writer.begin_row();
+		writer.number(t->id);
+		writer.number(t->seeders);
+		writer.number(t->leechers);
+		writer.number(t->snatched);
+		writer.number(t->balance);
+		writer.end_row();
+	}
+	torrent_records.clear();
+	torrent_stream.push(writer.finish());
+	if (torrent_cleanup.exchange(false)) {
+		torrent_stream.push("DELETE FROM torrents WHERE info_hash = ''");
 	}
 }
 
 void mysql::flush_snatches() {
-	std::string sql;
-	boost::mutex::scoped_lock lock(snatch_buffer_lock);
-	if (update_snatch_buffer == "" ) {
+	if (snatch_records.empty()) {
 		return;
 	}
-	sql = "INSERT INTO xbt_snatched (uid, fid, tstamp, IP) VALUES " + update_snatch_buffer;
-	snatch_queue.push(sql);
-	update_snatch_buffer.clear();
-	if (snatch_queue.size() == 1 && s_active == false) {
-		boost::thread thread(&mysql::do_flush_snatches, this);
+	bulk_writer writer(snatches_table, bulk, max_statement);
+	for (std::vector<snatch_record>::const_iterator s = snatch_records.begin(); s != snatch_records.end(); s++) {
+		writer.begin_row();
+		writer.number(s->userid);
+		writer.number(s->torrentid);
+		writer.number(s->tstamp);
+		writer.text(ip_to_string(s->ip));
+		writer.end_row();
 	}
+	snatch_records.clear();
+	snatch_stream.push(writer.finish());
 }
 
-void mysql::flush_peers() {
-	std::string sql;
-	boost::mutex::scoped_lock lock(peer_buffer_lock);
-	// because xfu inserts are slow and ram is not infinite we need to
-	// limit this queue's size
-	if (peer_queue.size() >= 1000) {
-		peer_queue.pop();
-	}
-	if (update_peer_buffer == "") {
+void mysql::flush_peers(bool closing) {
+	// While the last flush is still waiting, keep merging rows in
+	// peer_rows instead of queueing another one
+	if ((peer_stream.size() > 0 && !closing) || peer_rows.empty()) {
 		return;
 	}
-	
-	if (peer_queue.size() == 0) {
-		sql = "SET session sql_log_bin = 0";
-		peer_queue.push(sql);
-		sql.clear();
-	}
-	
-	// Added port below to record it into the DB. //Mobbo
-	sql = "INSERT INTO xbt_files_users (uid,fid,active,uploaded,downloaded,upspeed,downspeed,remaining," +
-		std::string("timespent,announced,ip,port,peer_id,useragent,mtime) VALUES ") + update_peer_buffer + 
-				" ON DUPLICATE KEY UPDATE active=VALUES(active), uploaded=VALUES(uploaded), " +
-				"downloaded=VALUES(downloaded), upspeed=VALUES(upspeed), " +
-				"downspeed=VALUES(downspeed), remaining=VALUES(remaining), " +
-				"timespent=VALUES(timespent), announced=VALUES(announced), " + 
-				"mtime=VALUES(mtime), port=VALUES(port)";
-	peer_queue.push(sql);
-	update_peer_buffer.clear();
-	if (peer_queue.size() == 2 && p_active == false) {
-		boost::thread thread(&mysql::do_flush_peers, this);
+	bulk_writer writer(peers_table, bulk, max_statement);
+	for (peer_row_map::const_iterator i = peer_rows.begin(); i != peer_rows.end(); i++) {
+		const peer_row_key &key = i->first;
+		const peer_row &row = i->second;
+		writer.begin_row();
+		writer.number(key.userid);
+		writer.number(key.torrentid);
+		writer.number(row.active);
+		writer.number(row.uploaded);
+		writer.number(row.downloaded);
+		writer.number(row.upspeed);
+		writer.number(row.downspeed);
+		writer.number(row.left);
+		writer.number(row.timespent);
+		writer.number(row.announces);
+		writer.text(ip_to_string(row.ip));
+		writer.number(row.port);
+		writer.text(reinterpret_cast<const char *>(key.peer_id.data()), key.peer_id.size());
+		writer.text(user_agents.get(row.user_agent));
+		writer.number(row.mtime);
+		writer.end_row();
 	}
+	peer_rows.clear();
+	peer_stream.push(writer.finish());
 }
 
 void mysql::flush_peer_hist() {
-	std::string sql;
-	boost::mutex::scoped_lock lock(peer_hist_buffer_lock);
-	if (update_peer_hist_buffer == "") {
+	if (peer_hist_records.empty()) {
 		return;
 	}
-
-	if (peer_hist_queue.size() == 0) {
-		sql = "SET session sql_log_bin = 0";
-		peer_hist_queue.push(sql);
-		sql.clear();
-	}
-
-	sql = "INSERT IGNORE INTO xbt_peers_history (uid, downloaded, remaining, uploaded, upspeed, downspeed, timespent, peer_id, ip, fid, mtime) VALUES " + update_peer_hist_buffer;
-	peer_hist_queue.push(sql);
-	update_peer_hist_buffer.clear();
-	if (peer_hist_queue.size() == 2 && hist_active == false) {
-		boost::thread thread(&mysql::do_flush_peer_hist, this);
+	bulk_writer writer(peer_hist_table, bulk, max_statement);
+	for (std::vector<peer_hist_record>::const_iterator h = peer_hist_records.begin(); h != peer_hist_records.end(); h++) {
+		writer.begin_row();
+		writer.number(h->userid);
+		writer.number(h->downloaded);
+		writer.number(h->left);
+		writer.number(h->uploaded);
+		writer.number(h->upspeed);
+		writer.number(h->downspeed);
+		writer.number(h->timespent);
+		writer.text(reinterpret_cast<const char *>(h->peer_id.data()), h->peer_id.size());
+		writer.text(ip_to_string(h->ip));
+		writer.number(h->torrentid);
+		writer.number(h->mtime);
+		writer.end_row();
 	}
+	peer_hist_records.clear();
+	peer_hist_stream.push(writer.finish());
 }
 
 void mysql::flush_tokens() {
-	std::string sql;
-	boost::mutex::scoped_lock lock(user_token_lock);
-	if (update_token_buffer == "") {
+	if (token_deltas.empty()) {
 		return;
 	}
-	sql = "INSERT INTO users_freeleeches (UserID, TorrentID, Downloaded, Uploaded) VALUES " + update_token_buffer +
-		" ON DUPLICATE KEY UPDATE Downloaded = Downloaded + VALUES(Downloaded), Uploaded = Uploaded + VALUES(Uploaded)";
-	token_queue.push(sql);
-	update_token_buffer.clear();
-	if (token_queue.size() == 1 && tok_active == false) {
-		boost::thread(&mysql::do_flush_tokens, this);
+	bulk_writer writer(tokens_table, bulk, max_statement);
+	for (std::unordered_map<uint64_t, token_delta>::const_iterator i = token_deltas.begin(); i != token_deltas.end(); i++) {
+		writer.begin_row();
+		writer.number(static_cast<int>(i->first >> 32));
+		writer.number(static_cast<int>(i->first & 0xFFFFFFFF));
+		writer.number(i->second.downloaded);
+		writer.number(i->second.uploaded);
+		writer.end_row();
 	}
+	token_deltas.clear();
+	token_stream.push(writer.finish());
 }
 
-void mysql::do_flush_users() {
-	u_active = true;
-	mysqlpp::Connection c(db.c_str(), server.c_str(), db_user.c_str(), pw.c_str(), 0);
-	while (user_queue.size() > 0) {
-		try {
-			std::string sql = user_queue.front();
-			mysqlpp::Query query = c.query(sql);
-			if (!query.exec()) {
-				std::cout << "User flush failed (" << user_queue.size() << " remain)" << std::endl;
-				sleep(3);
-				continue;
-			} else {
-				boost::mutex::scoped_lock lock(user_buffer_lock);
-				user_queue.pop();
-				std::cout << "Users flushed (" << user_queue.size() << " remain)" << std::endl;
-			}
-		} 
-		catch (const mysqlpp::BadQuery &er) {
-			std::cerr << "Query error: " << er.what() << " in flush users with a qlength: " << user_queue.front().size() << " queue size: " << user_queue.size() << std::endl;
-			sleep(3);
-			continue;
-		} catch (const mysqlpp::Exception &er) {
-			std::cerr << "Query error: " << er.what() << " in flush users with a qlength: " << user_queue.front().size() <<  " queue size: " << user_queue.size() << std::endl;
-			sleep(3);
-			continue;
+//---------- Flush streams
+
+flush_stream::flush_stream(const std::string &stream_name, const std::string &mysql_db, const std::string &mysql_host,
+	const std::string &username, const std::string &password) :
+	name(stream_name), db(mysql_db), server(mysql_host), db_user(username), pw(password), local_infile(false),
+	conn(false), memory_budget(0), memory_used(0), unjournaled(0), spilling(false), active(false), stopping(false),
+	query_failed(false), query_failures(0) {
+}
+
+// Only the replayed jobs that fit the budget are read into memory, the rest
+// are queued spilled, so a journal left by a long outage needs no more memory
+// at startup than while it was written
+void flush_stream::open_journal(const std::string &dir, const std::string &file_name, size_t max_memory) {
+	std::vector<journal_position> positions;
+	boost::mutex::scoped_lock l(lock);
+	memory_budget = max_memory;
+	// Segments are a quarter of the budget, so acknowledged jobs leave the disk soon
+	journal.reset(new flush_journal(dir, file_name, std::max<size_t>(max_memory / 4, 1 << 20)));
+	journal->replay(positions);
+	for(size_t i = 0; i < positions.size(); i++) {
+		// A record is a little larger than the job it holds
+		flush_job job;
+		if(memory_used + positions[i].length <= memory_budget && journal->read(positions[i], job)) {
+			queue_job(job, true, positions[i]);
+		} else {
+			queue_spilled(positions[i], positions[i].length);
 		}
 	}
-	u_active = false;
+	if(!positions.empty()) {
+		std::cout << "Replayed " << positions.size() << " " << name << " flushes from the journal" << std::endl;
+		ready.notify_one();
+	}
 }
 
-void mysql::do_flush_torrents() {
-	t_active = true;
-	mysqlpp::Connection c(db.c_str(), server.c_str(), db_user.c_str(), pw.c_str(), 0);
-	while (torrent_queue.size() > 0) {
-		try {
-			std::string sql = torrent_queue.front();
-			if (sql == "") {
-				torrent_queue.pop();
-				continue;
-			}
-			mysqlpp::Query query = c.query(sql);
-			if (!query.exec()) {
-				std::cout << "Torrent flush failed (" << torrent_queue.size() << " remain)" << std::endl;
-				sleep(3);
-				continue;
-			} else {
-				boost::mutex::scoped_lock lock(torrent_buffer_lock);
-				torrent_queue.pop();
-				std::cout << "Torrents flushed (" << torrent_queue.size() << " remain)" << std::endl;
-			}
-		}
-		catch (const mysqlpp::BadQuery &er) {
-			std::cerr << "Query error: " << er.what() << " in flush torrents with a qlength: " << torrent_queue.front().size() << " queue size: " << torrent_queue.size() << std::endl;
-			sleep(3);
-			continue;
-		} catch (const mysqlpp::Exception &er) {
-			std::cerr << "Query error: " << er.what() << " in flush torrents with a qlength: " << torrent_queue.front().size() << " queue size: " << torrent_queue.size() << std::endl;
-			sleep(3);
-			continue;
-		}
+void flush_stream::start() {
+	boost::thread thread(&flush_stream::run, this);
+}
+
+void flush_stream::push(const std::string &sql) {
+	flush_job job;
+	job.statements.push_back(sql);
+	push(job);
+}
+
+void flush_stream::push(const std::vector<flush_job> &jobs) {
+	for(size_t i = 0; i < jobs.size(); i++) {
+		push(jobs[i]);
 	}
-	t_active = false;
 }
 
-void mysql::do_flush_peers() {
-	p_active = true;
-	mysqlpp::Connection c(db.c_str(), server.c_str(), db_user.c_str(), pw.c_str(), 0);
-	while (peer_queue.size() > 0) {
-		try {
-			std::string sql = peer_queue.front();
-			mysqlpp::Query query = c.query(sql);
-			if (!query.exec()) {
-				std::cout << "Peer flush failed (" << peer_queue.size() << " remain)" << std::endl;
-				sleep(3);
-				continue;
-			} else {
-				boost::mutex::scoped_lock lock(peer_buffer_lock);
-				peer_queue.pop();
-				std::cout << "Peers flushed (" << peer_queue.size() << " remain)" << std::endl;
-			}
-		}
-		catch (const mysqlpp::BadQuery &er) {
-			std::cerr << "Query error: " << er.what() << " in flush peers with a qlength: " << peer_queue.front().size() << " queue size: " << peer_queue.size() << std::endl;
-			sleep(3);
-			continue;
-		} catch (const mysqlpp::Exception &er) {
-			std::cerr << "Query error: " << er.what() << " in flush peers with a qlength: " << peer_queue.front().size() << " queue size: " << peer_queue.size() << std::endl;
-			sleep(3);
-			continue;
-		}
+void flush_stream::push(const flush_job &job) {
+	boost::mutex::scoped_lock l(lock);
+	journal_position position;
+	bool journaled = journal && journal->append(job, position);
+	queue_job(job, journaled, position);
+	ready.notify_one();
+}
+
+// Keeps the job in memory, unless it's in the journal and the budget is used up
+void flush_stream::queue_job(const flush_job &job, bool journaled, const journal_position &position) {
+	queue.push(queued_job());
+	queued_job &queued = queue.back();
+	queued.journaled = journaled;
+	queued.position = position;
+	queued.bytes = job.infile_data.size();
+	for(size_t i = 0; i < job.statements.size(); i++) {
+		queued.bytes += job.statements[i].size();
+	}
+	queued.spilled = journaled && memory_used + queued.bytes > memory_budget;
+	if(queued.spilled != spilling) {
+		spilling = queued.spilled;
+		std::cout << name << (spilling ? " queue is over its memory budget, spilling to the journal" : " queue is back in memory") << std::endl;
+	}
+	if(!queued.spilled) {
+		queued.job = job;
+		memory_used += queued.bytes;
+	}
+	if(!journaled) {
+		unjournaled++;
 	}
-	p_active = false;
 }
 
-void mysql::do_flush_peer_hist() {
-	hist_active = true;
-	mysqlpp::Connection c(db.c_str(), server.c_str(), db_user.c_str(), pw.c_str(), 0);
-	while (peer_hist_queue.size() > 0) {
-		try {
-			std::string sql = peer_hist_queue.front();
-			mysqlpp::Query query = c.query(sql);
-			if (!query.exec()) {
-				std::cout << "Peer history flush failed (" << peer_hist_queue.size() << " remain)" << std::endl;
-				sleep(3);
-				continue;
-			} else {
-				boost::mutex::scoped_lock lock(peer_hist_buffer_lock);
-				peer_hist_queue.pop();
-				std::cout << "Peer history flushed (" << peer_hist_queue.size() << " remain)" << std::endl;
-			}
+// A job that is only in the journal, to be read back when it's run
+void flush_stream::queue_spilled(const journal_position &position, size_t bytes) {
+	queue.push(queued_job());
+	queued_job &queued = queue.back();
+	queued.journaled = true;
+	queued.spilled = true;
+	queued.position = position;
+	queued.bytes = bytes;
+	if(!spilling) {
+		spilling = true;
+		std::cout << name << " queue is over its memory budget, spilling to the journal" << std::endl;
+	}
+}
+
+void flush_stream::sync() {
+	boost::mutex::scoped_lock l(lock);
+	if(journal) {
+		journal->sync();
+	}
+}
+
+size_t flush_stream::size() {
+	boost::mutex::scoped_lock l(lock);
+	return queue.size();
+}
+
+// Called when shutting down, true once the stream can be left. Without a
+// journal that's when everything has been written. With one it's as soon as
+// the running job is done and the rest are safely in the journal, which are
+// then run when the tracker starts again.
+bool flush_stream::stop() {
+	boost::mutex::scoped_lock l(lock);
+	if(!journal) {
+		return queue.empty() && !active;
+	}
+	if(unjournaled > 0) {
+		return false;
+	}
+	stopping = true;
+	return !active && journal->synced();
+}
+
+// (Re)connect and set up the session, true if the connection is usable
+bool flush_stream::connect() {
+	if(conn.connected()) {
+		return true;
+	}
+	if(local_infile) {
+		conn.set_option(new mysqlpp::LocalFilesOption(true));
+	}
+	if(!conn.connect(db.c_str(), server.c_str(), db_user.c_str(), pw.c_str(), 0)) {
+		std::cerr << name << " flush could not connect to MySQL: " << conn.error() << std::endl;
+		return false;
+	}
+	for(size_t i = 0; i < session_sql.size(); i++) {
+		mysqlpp::Query query = conn.query(session_sql[i]);
+		if(!query.exec()) {
+			std::cerr << name << " flush could not set up session: " << query.error() << std::endl;
+			conn.disconnect();
+			return false;
 		}
-		catch (const mysqlpp::BadQuery &er) {
-			std::cerr << "Query error: " << er.what() << " in flush peer history with a qlength: " << peer_hist_queue.front().size() << " queue size: " << peer_hist_queue.size() << std::endl;
-			sleep(3);
+	}
+	return true;
+}
+
+// Writes the rows of a load to a new file that only this user can open.
+// mkstemp picks an unused name and won't follow a link planted there.
+bool flush_stream::write_infile(const std::string &data, std::string &path) {
+	char file_name[] = "/dev/shm/ocelot-XXXXXX";
+	int fd = mkstemp(file_name);
+	if(fd == -1) {
+		std::cerr << name << " flush could not create an infile: " << strerror(errno) << std::endl;
+		return false;
+	}
+	path = file_name;
+	size_t written = 0;
+	while(written < data.size()) {
+		ssize_t n = write(fd, data.data() + written, data.size() - written);
+		if(n < 0 && errno == EINTR) {
 			continue;
-		} catch (const mysqlpp::Exception &er) {
-			std::cerr << "Query error: " << er.what() << " in flush peer history with a qlength: " << peer_hist_queue.front().size() << " queue size: " << peer_hist_queue.size() << std::endl;
-		sleep(3);
-		continue;
 		}
+		if(n <= 0) {
+			std::cerr << name << " flush could not write " << path << ": " << strerror(errno) << std::endl;
+			close(fd);
+			unlink(file_name);
+			return false;
+		}
+		written += n;
 	}
-	hist_active = false;
+	close(fd);
+	return true;
 }
 
-void mysql::do_flush_snatches() {
-	s_active = true;
-	mysqlpp::Connection c(db.c_str(), server.c_str(), db_user.c_str(), pw.c_str(), 0);
-	while (snatch_queue.size() > 0) {
-		try {
-			std::string sql = snatch_queue.front();
-			mysqlpp::Query query = c.query(sql);
-			if (!query.exec()) {
-				std::cout << "Snatch flush failed (" << snatch_queue.size() << " remain)" << std::endl;
-				sleep(3);
-				continue;
-			} else {
-				boost::mutex::scoped_lock lock(snatch_buffer_lock);
-				snatch_queue.pop();
-				std::cout << "Snatches flushed (" << snatch_queue.size() << " remain)" << std::endl;
-			}
-		} 
-		catch (const mysqlpp::BadQuery &er) {
-			std::cerr << "Query error: " << er.what() << " in flush snatches with a qlength: " << snatch_queue.front().size() << " queue size: " << snatch_queue.size() << std::endl;
-			sleep(3);
-			continue;
-		} catch (const mysqlpp::Exception &er) {
-			std::cerr << "Query error: " << er.what() << " in flush snatches with a qlength: " << snatch_queue.front().size() << " queue size: " << snatch_queue.size() << std::endl;
-			sleep(3);
-			continue;
+// Client errors for a lost or refused connection, and server errors that
+// are over once the server or the competing transaction is
+static bool transient_error(int errnum) {
+	switch(errnum) {
+		case 1040: // Too many connections
+		case 1053: // Server shutdown in progress
+		case 1205: // Lock wait timeout
+		case 1213: // Deadlock
+		case 2002: // CR_CONNECTION_ERROR
+		case 2003: // CR_CONN_HOST_ERROR
+		case 2006: // CR_SERVER_GONE_ERROR
+		case 2013: // CR_SERVER_LOST
+		case 2055: // CR_SERVER_LOST_EXTENDED
+			return true;
+	}
+	return false;
+}
+
+bool flush_stream::run_statement(const std::string &sql) {
+	mysqlpp::Query query = conn.query(sql);
+	if(!query.exec()) {
+		std::cerr << name << " flush failed: " << query.error() << " (" << query.errnum() << ")" << std::endl;
+		query_failed = !transient_error(query.errnum());
+		return false;
+	}
+	return true;
+}
+
+void flush_stream::drop_job(const flush_job &job) {
+	std::cerr << name << " flush failed " << query_failures << " times on a working connection, dropping it. Its statements were:" << std::endl;
+	for(size_t i = 0; i < job.statements.size(); i++) {
+		std::cerr << "  " << job.statements[i].substr(0, 200) << (job.statements[i].size() > 200 ? "..." : "") << std::endl;
+	}
+	if(!job.infile_data.empty()) {
+		std::cerr << "  with " << job.infile_data.size() << " bytes loaded " << job.infile_into << std::endl;
+	}
+}
+
+// Runs the statements of a job in order, stopping at the first that fails
+bool flush_stream::run_job(const flush_job &job) {
+	std::string infile;
+	if(!job.infile_data.empty() && !write_infile(job.infile_data, infile)) {
+		return false;
+	}
+	bool done = true;
+	for(size_t i = 0; i < job.statements.size() && done; i++) {
+		if(!infile.empty() && i + 1 == job.statements.size()) {
+			done = run_statement("LOAD DATA LOCAL INFILE '" + infile + "' " + job.infile_into);
 		}
+		done = done && run_statement(job.statements[i]);
+	}
+	if(!infile.empty()) {
+		unlink(infile.c_str());
 	}
-	s_active = false;
+	return done;
 }
 
-void mysql::do_flush_tokens() {
-	tok_active = true;
-	mysqlpp::Connection c(db.c_str(), server.c_str(), db_user.c_str(), pw.c_str(), 0);
-	while (token_queue.size() > 0) {
-		try {
-			std::string sql = token_queue.front();
-			mysqlpp::Query query = c.query(sql);
-			if (!query.exec()) {
-				std::cout << "Token flush failed (" << token_queue.size() << " remain)" << std::endl;
-				sleep(3);
-				continue;
-			} else {
-				boost::mutex::scoped_lock lock(user_token_lock);
-				token_queue.pop();
-				std::cout << "Tokens flushed (" << token_queue.size() << " remain)" << std::endl;
+void flush_stream::run() {
+	unsigned int backoff = 1;
+	for(;;) {
+		flush_job job;
+		bool spilled;
+		journal_position position;
+		{
+			boost::mutex::scoped_lock l(lock);
+			while(queue.empty() || stopping) {
+				ready.wait(l);
 			}
+			const queued_job &front = queue.front();
+			spilled = front.spilled;
+			position = front.position;
+			if(!spilled) {
+				job = front.job;
+			}
+			active = true;
 		}
-		catch (const mysqlpp::BadQuery &er) {
-			std::cerr << "Query error: " << er.what() << " in flush tokens with a qlength: " << token_queue.front().size() << " queue size: " << token_queue.size() << std::endl;
-			sleep(3);
-			continue;
+		
+		bool done = false, lost = false;
+		if(spilled && !journal->read(position, job)) {
+			std::cerr << name << " flush could not be read back from the journal, skipping it" << std::endl;
+			lost = true;
+		}
+		query_failed = false;
+		try {
+			done = lost || (connect() && run_job(job));
 		} catch (const mysqlpp::Exception &er) {
-			std::cerr << "Query error: " << er.what() << " in flush tokens with a qlength: " << token_queue.front().size() << " queue size: " << token_queue.size() << std::endl;
-			sleep(3);
-			continue;
+			std::cerr << "Query error: " << er.what() << " in " << name << " flush with a qlength: "
+				<< (job.statements.empty() ? 0 : job.statements.back().size()) << std::endl;
+			query_failed = true;
+		}
+		if(!done && query_failed && ++query_failures >= FLUSH_JOB_ATTEMPTS) {
+			drop_job(job);
+			done = true;
+		}
+		
+		boost::mutex::scoped_lock l(lock);
+		active = false;
+		if(done) {
+			query_failures = 0;
+			const queued_job &front = queue.front();
+			if(!front.spilled) {
+				memory_used -= front.bytes;
+			}
+			if(front.journaled) {
+				journal->acknowledge(front.position);
+			} else {
+				unjournaled--;
+			}
+			queue.pop();
+			std::cout << name << " flushed (" << queue.size() << " remain)" << std::endl;
+			backoff = 1;
+		} else {
+			// Start over on a fresh connection, after waiting a little longer every time
+			conn.disconnect();
+			std::cout << name << " flush failed (" << queue.size() << " remain), retrying in " << backoff << "s" << std::endl;
+			l.unlock();
+			boost::this_thread::sleep(boost::posix_time::seconds(backoff));
+			backoff = std::min(backoff * 2, 60u);
 		}
 	}
-	tok_active = false;
 }
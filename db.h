@@ -4,73 +4,288 @@
 #include <mysql++/mysql++.h>
 #include <string>
 #include <unordered_map>
+#include <stdint.h>
 #include <queue>
+#include <memory>
+#include <atomic>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/functional/hash.hpp>
 #include "logger.h"
+#include "string_table.h"
+#include "record_ring.h"
+#include "bulk_writer.h"
+#include "journal.h"
 
-class mysql {
+// Records each thread can queue before the rest spill into a locked vector
+#define RECORD_RING_SIZE 16384
+
+// Limits on the user agents kept, see string_table. Agents are cut to the
+// size of xbt_files_users.useragent.
+#define USER_AGENT_LENGTH 255
+#define USER_AGENT_LIMIT 50000
+#define USER_AGENTS_PER_USER 16
+
+// Times a job can fail on a working connection before it's dropped
+#define FLUSH_JOB_ATTEMPTS 5
+
+// A job waiting in a flush_stream. Once the jobs kept in memory are over
+// the stream's budget, new ones are only kept in the journal.
+typedef struct {
+	flush_job job; // Empty if spilled
+	bool journaled;
+	bool spilled;
+	journal_position position;
+	size_t bytes;
+} queued_job;
+
+// The jobs for one table, run in order by a thread of its own over a
+// connection that's kept open between flushes. Failed jobs are retried from
+// their first statement with a growing delay, reconnecting first if the
+// connection was lost. A job that keeps failing while the server is
+// reachable (bad data, say) is logged and dropped after FLUSH_JOB_ATTEMPTS
+// tries, so it can't hold up the stream.
+// With a journal, every job is in it until MySQL has taken it, so jobs
+// survive restarts and the stream can stop without waiting for MySQL.
+class flush_stream {
 	private:
+		std::string name;
+		std::string db, server, db_user, pw;
+		std::vector<std::string> session_sql; // Run after every connect
+		bool local_infile; // Allow LOAD DATA LOCAL, for BULK_LOAD_DATA
+		
 		mysqlpp::Connection conn;
-		std::string update_user_buffer;
-		std::string update_torrent_buffer;
-		std::string update_peer_buffer;
-		std::string update_snatch_buffer;
-		std::string update_token_buffer;
-		std::string update_peer_hist_buffer;
+		std::queue<queued_job> queue;
+		std::unique_ptr<flush_journal> journal; // NULL if not journaling
+		size_t memory_budget; // Bytes of queued jobs to keep in memory
+		size_t memory_used;
+		size_t unjournaled; // Queued jobs that are only in memory
+		bool spilling; // The last job pushed was spilled
+		bool active; // Running a job
+		bool stopping; // Don't start any more jobs
+		bool query_failed; // The last job failed for a reason other than the connection
+		unsigned int query_failures; // Such failures of the job at the front
+		boost::mutex lock;
+		boost::condition_variable ready;
 		
-		std::queue<std::string> user_queue;
-		std::queue<std::string> torrent_queue;
-		std::queue<std::string> peer_queue;
-		std::queue<std::string> snatch_queue;
-		std::queue<std::string> token_queue;
-		std::queue<std::string> peer_hist_queue;
+		bool connect();
+		void drop_job(const flush_job &job);
+		bool write_infile(const std::string &data, std::string &path);
+		bool run_statement(const std::string &sql);
+		bool run_job(const flush_job &job);
+		void run();
+		void queue_job(const flush_job &job, bool journaled, const journal_position &position);
+		void queue_spilled(const journal_position &position, size_t bytes);
+	
+	public:
+		flush_stream(const std::string &stream_name, const std::string &mysql_db, const std::string &mysql_host,
+			const std::string &username, const std::string &password);
+		
+		void add_session_sql(const std::string &sql) { session_sql.push_back(sql); }
+		void allow_local_infile() { local_infile = true; }
+		void open_journal(const std::string &dir, const std::string &file_name, size_t max_memory);
+		void start();
+		void push(const std::string &sql);
+		void push(const flush_job &job);
+		void push(const std::vector<flush_job> &jobs);
+		void sync(); // Make every journaled job durable
+		size_t size();
+		bool stop();
+};
 
-		std::string db, server, db_user, pw;
-		bool u_active, t_active, p_active, s_active, tok_active, hist_active;
-
-		// These locks prevent more than one thread from reading/writing the buffers.
-		// These should be held for the minimum time possible.
-		boost::mutex user_buffer_lock;
-		boost::mutex torrent_buffer_lock;
-		boost::mutex peer_buffer_lock;
-		boost::mutex snatch_buffer_lock;
-		boost::mutex user_token_lock;
-		boost::mutex peer_hist_buffer_lock;
+// Byte counts added up between flushes, so every flush writes one row per
+// user (or user and torrent, for tokens) however often they announced
+typedef struct {
+	long long uploaded;
+	long long downloaded;
+	long long real_uploaded;
+	long long real_downloaded;
+} user_delta;
+
+typedef struct {
+	long long downloaded;
+	long long uploaded;
+} token_delta;
+
+// The latest state of a peer's xbt_files_users row. Announces overwrite the
+// row for their (user, torrent, peer id) until the next flush writes it.
+typedef struct {
+	int userid;
+	int torrentid;
+	peerid_t peer_id;
+} peer_row_key;
+
+inline bool operator==(const peer_row_key &a, const peer_row_key &b) {
+	return a.userid == b.userid && a.torrentid == b.torrentid && a.peer_id == b.peer_id;
+}
+
+struct peer_row_hash {
+	size_t operator()(const peer_row_key &key) const {
+		size_t hash = boost::hash_range(key.peer_id.begin(), key.peer_id.end());
+		boost::hash_combine(hash, key.userid);
+		boost::hash_combine(hash, key.torrentid);
+		return hash;
+	}
+};
+
+typedef struct {
+	int active;
+	long long uploaded;
+	long long downloaded;
+	long long upspeed;
+	long long downspeed;
+	uint64_t left;
+	time_t timespent;
+	unsigned int announces;
+	uint32_t ip;
+	unsigned int port;
+	string_id user_agent;
+	time_t mtime;
+} peer_row;
+
+typedef std::unordered_map<peer_row_key, peer_row, peer_row_hash> peer_row_map;
+
+// What announces and the torrent flush hand to the database, as fixed size
+// records. They are only turned into SQL by mysql::flush.
+typedef struct {
+	int id;
+	long long uploaded;
+	long long downloaded;
+	long long real_uploaded;
+	long long real_downloaded;
+} user_record;
+
+typedef struct {
+	int userid;
+	int torrentid;
+	long long downloaded;
+	long long uploaded;
+} token_record;
+
+typedef struct {
+	int id;
+	size_t seeders;
+	size_t leechers;
+	int snatched; // Since the last record
+	long long balance;
+} torrent_record;
+
+typedef struct {
+	int userid;
+	int torrentid;
+	time_t tstamp;
+	uint32_t ip;
+} snatch_record;
+
+typedef struct {
+	peer_row_key key;
+	peer_row row;
+} peer_record;
+
+typedef struct {
+	int userid;
+	int torrentid;
+	long long downloaded;
+	uint64_t left;
+	long long uploaded;
+	long long upspeed;
+	long long downspeed;
+	time_t timespent;
+	peerid_t peer_id;
+	uint32_t ip;
+	time_t mtime;
+} peer_hist_record;
+
+// One ring of each record type per thread that records anything
+struct record_rings {
+	record_ring<user_record> users;
+	record_ring<token_record> tokens;
+	record_ring<torrent_record> torrents;
+	record_ring<snatch_record> snatches;
+	record_ring<peer_record> peers;
+	record_ring<peer_hist_record> peer_hist;
+
+	explicit record_rings(size_t capacity) : users(capacity), tokens(capacity), torrents(capacity),
+		snatches(capacity), peers(capacity), peer_hist(capacity) {}
+};
+
+class mysql {
+	private:
+		mysqlpp::Connection conn;
+		
+		// Every thread pushes to its own rings, which only the flush reads
+		boost::thread_specific_ptr<record_rings> local_rings;
+		std::vector<std::unique_ptr<record_rings> > all_rings;
+		boost::mutex rings_lock; // Guards all_rings
+		record_rings &rings();
+		void drain_rings();
+		
+		// Filled from the rings by the flush, which is the only thread using them
+		std::unordered_map<int, user_delta> user_deltas;
+		std::unordered_map<uint64_t, token_delta> token_deltas; // Keyed by user id << 32 | torrent id
+		std::vector<torrent_record> torrent_records;
+		peer_row_map peer_rows;
+		std::vector<snatch_record> snatch_records;
+		std::vector<peer_hist_record> peer_hist_records;
+		std::atomic<bool> torrent_cleanup; // Remove empty torrent rows after the next torrent flush
 		
-		void do_flush_users();
-		void do_flush_torrents();
-		void do_flush_snatches();
-		void do_flush_peers();
-		void do_flush_tokens();
-		void do_flush_peer_hist();
+		flush_stream user_stream;
+		flush_stream torrent_stream;
+		flush_stream peer_stream;
+		flush_stream snatch_stream;
+		flush_stream token_stream;
+		flush_stream peer_hist_stream;
 
+		bulk_mode bulk;
+		size_t max_statement; // Bytes per statement for BULK_INSERT
+		
+		// Peers only keep the id of their user agent
+		string_table user_agents;
+		
 		void flush_users();
 		void flush_torrents();
 		void flush_snatches();
-		void flush_peers();
+		void flush_peers(bool closing);
 		void flush_tokens();
 		void flush_peer_hist();
+		void flush(bool closing);
+		bool check_clear();
+
+		// Flushes run on a thread of their own, so the schedule only has to
+		// wake it instead of holding up the event loop it runs on
+		boost::mutex flush_lock;
+		boost::condition_variable flush_wanted;
+		bool flush_requested;
+		bool flush_closing; // Once set, every flush is a closing one
+		std::atomic<bool> cleared; // Set by a closing flush once nothing is left to write
+		void run_flush();
 
 	public:
-		mysql(std::string mysql_db, std::string mysql_host, std::string username, std::string password);
+		mysql(std::string mysql_db, std::string mysql_host, std::string username, std::string password,
+			const std::string &flush_mode, size_t max_statement_size);
                 void load_site_options(site_options_t &site_options);
-		void load_torrents(std::unordered_map<std::string, torrent> &torrents);
-		void load_users(std::unordered_map<std::string, user> &users);
-		void load_tokens(std::unordered_map<std::string, torrent> &torrents);
+		void load_torrents(torrent_store &torrents);
+		void load_users(user_list &users);
+		void load_tokens(torrent_store &torrents);
 		void load_blacklist(std::vector<std::string> &blacklist);
 		
-		void record_user(std::string &record); // (id,uploaded_change,downloaded_change)
-		void record_torrent(std::string &record); // (id,seeders,leechers,snatched_change,balance)
-		void record_snatch(std::string &record); // (uid,fid,tstamp)
-		void record_peer(std::string &record, std::string &ip, int port, std::string &peer_id, std::string &useragent); // (uid,fid,active,peerid,useragent,ip,port,uploaded,downloaded,upspeed,downspeed,left,timespent,announces)
-		void record_token(std::string &record);
-		void record_peer_hist(std::string &record, std::string &peer_id, std::string &ip, int tid);
+		void record_user(int id, long long uploaded, long long downloaded, long long real_uploaded, long long real_downloaded);
+		void record_torrent(int id, size_t seeders, size_t leechers, int snatched, long long balance);
+		void clean_torrents();
+		void record_snatch(int userid, int torrentid, time_t tstamp, uint32_t ip);
+		void record_peer(const peer_row_key &key, const peer_row &row);
+		void record_token(int userid, int torrentid, long long downloaded, long long uploaded);
+		void record_peer_hist(const peer_hist_record &record);
 
-		void flush();
+		string_id intern_user_agent(const boost::string_ref &useragent, int userid) { return user_agents.intern(useragent, userid); }
+		size_t user_agent_count() { return user_agents.size(); }
+
+		void open_journals(const std::string &dir, size_t max_memory);
+		void request_flush(bool closing);
+
+		bool all_clear() { return cleared; }
 
-		bool all_clear();
-		
-		boost::mutex torrent_list_mutex;
 
 		logger* logger_ptr;
 };
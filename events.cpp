@@ -5,6 +5,9 @@
 #include "events.h"
 #include "schedule.h"
 #include <cerrno>
+#include <cstdio>
+#include <algorithm>
+#include <boost/thread/thread.hpp>
 
 
 
@@ -12,14 +15,83 @@
 
 //TODO Better errors
 
-//---------- Connection mother - spawns middlemen and lets them deal with the connection
+//---------- Connection mother - starts the connection loops and the schedule
 
-connection_mother::connection_mother(worker * worker_obj, config * config_obj, mysql * db_obj) : work(worker_obj), conf(config_obj), db(db_obj) {
+connection_mother::connection_mother(worker * worker_obj, config * config_obj, mysql * db_obj) : work(worker_obj), conf(config_obj), db(db_obj), pool(NULL) {
+	if(conf->worker_threads > 0) {
+		// A middleman never has more than one request in the pool
+		pool = new worker_pool(conf->worker_threads, conf->max_middlemen);
+		std::cout << "Started " << conf->worker_threads << " worker thread(s)" << std::endl;
+	}
+	
+	unsigned int num_loops = std::max(1u, conf->io_threads);
+	for(unsigned int i = 0; i < num_loops; i++) {
+		loops.push_back(new connection_loop(work, conf, pool));
+	}
+	
+	// Create libev timer on the first loop
+	schedule timer(this, worker_obj, conf, db);
+	
+	schedule_event.set(loops[0]->get_loop());
+	schedule_event.set<schedule, &schedule::handle>(&timer);
+	schedule_event.set(conf->schedule_interval, conf->schedule_interval); // After interval, every interval
+	schedule_event.start();
+	
+	std::cout << "Sockets up, starting " << num_loops << " event loop(s)!" << std::endl;
+	for(unsigned int i = 1; i < num_loops; i++) {
+		boost::thread thread(&connection_loop::run, loops[i]);
+	}
+	loops[0]->run();
+}
+
+int connection_mother::get_open_connections() {
+	int open = 0;
+	for(unsigned int i = 0; i < loops.size(); i++) {
+		open += loops[i]->get_open_connections();
+	}
+	return open;
+}
+
+int connection_mother::get_opened_connections() {
+	int opened = 0;
+	for(unsigned int i = 0; i < loops.size(); i++) {
+		opened += loops[i]->get_opened_connections();
+	}
+	return opened;
+}
+
+unsigned long connection_mother::get_shed_connections() {
+	unsigned long shed = 0;
+	for(unsigned int i = 0; i < loops.size(); i++) {
+		shed += loops[i]->get_shed_connections();
+	}
+	return shed;
+}
+
+connection_mother::~connection_mother()
+{
+	for(unsigned int i = 0; i < loops.size(); i++) {
+		delete loops[i];
+	}
+	delete pool;
+}
+
+
+
+
+
+
+
+//---------- Connection loop - one listen socket and event loop per thread
+
+connection_loop::connection_loop(worker * worker_obj, config * config_obj, worker_pool * pool_obj) :
+	work(worker_obj), conf(config_obj), pool(pool_obj), completed(config_obj->max_middlemen / std::max(1u, config_obj->io_threads)) {
 	open_connections = 0;
 	opened_connections = 0;
+	shed_connections = 0;
+	overloaded = false;
 	
 	memset(&address, 0, sizeof(address));
-	addr_len = sizeof(address);
 	
 	listen_socket = socket(AF_INET, SOCK_STREAM, 0);
 	
@@ -29,11 +101,23 @@ connection_mother::connection_mother(worker * worker_obj, config * config_obj, m
 		std::cout << "Could not reuse socket" << std::endl;
 	}
 	
-	// Create libev event loop
-	ev::io event_loop_watcher;
+	// Let every loop bind its own socket to the same port. Only done when
+	// there is more than one loop, so a second tracker can't silently share the port.
+	if(conf->io_threads > 1 && setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+		std::cout << "Could not set SO_REUSEPORT" << std::endl;
+	}
+	
+	// Watch the listen socket on this loop
+	listen_event.set(loop);
+	listen_event.set<connection_loop, &connection_loop::handle_connect>(this);
+	listen_event.start(listen_socket, ev::READ);
+	accept_retry.set(loop);
+	accept_retry.set<connection_loop, &connection_loop::handle_accept_retry>(this);
 	
-	event_loop_watcher.set<connection_mother, &connection_mother::handle_connect>(this);
-	event_loop_watcher.start(listen_socket, ev::READ);
+	// Pool threads wake the loop up when they're done with a request
+	completion_event.set(loop);
+	completion_event.set<connection_loop, &connection_loop::handle_completion>(this);
+	completion_event.start();
 	
 	// Get ready to bind
 	address.sin_family = AF_INET;
@@ -60,29 +144,113 @@ connection_mother::connection_mother(worker * worker_obj, config * config_obj, m
 		std::cout << "Could not set non-blocking" << std::endl;
 	}
 	
-	// Create libev timer
-	schedule timer(this, worker_obj, conf, db);
-	
-	schedule_event.set<schedule, &schedule::handle>(&timer);
-	schedule_event.set(conf->schedule_interval, conf->schedule_interval); // After interval, every interval
-	schedule_event.start();
+	// Create all middlemen up front. Each loop gets an equal share of max_middlemen.
+	unsigned int num_middlemen = conf->max_middlemen / std::max(1u, conf->io_threads);
+	middlemen.reserve(num_middlemen);
+	free_middlemen.reserve(num_middlemen);
+	for(unsigned int i = 0; i < num_middlemen; i++) {
+		middlemen.push_back(new connection_middleman(work, this, conf));
+		free_middlemen.push_back(middlemen.back());
+	}
 	
-	std::cout << "Sockets up, starting event loop!" << std::endl;
-	ev_loop(ev_default_loop(0), 0);
+	// After running out of middlemen, start accepting again once 10% are free
+	low_water_connections = num_middlemen - num_middlemen / 10;
 }
 
+void connection_loop::run() {
+	loop.run(0);
+}
 
-void connection_mother::handle_connect(ev::io &watcher, int events_flags) {
-	// Spawn a new middleman
-	if(open_connections < conf->max_middlemen) {
+// Accept everything the listen socket has queued, not just one connection per wakeup
+void connection_loop::handle_connect(ev::io &watcher, int events_flags) {
+	for(;;) {
+		sockaddr_in client_addr;
+		socklen_t client_addr_len = sizeof(client_addr);
+		int connect_sock = accept4(listen_socket, (sockaddr *) &client_addr, &client_addr_len, SOCK_NONBLOCK);
+		if(connect_sock == -1) {
+			if(errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+				// The pending connection stays queued, so the level-triggered
+				// watcher would fire again at once. Wait for connections to
+				// close, or retry shortly in case the descriptors are held
+				// by something other than this loop's connections.
+				stop_accepting(strerror(errno));
+				accept_retry.start(1.0);
+			} else if(errno != EAGAIN && errno != EWOULDBLOCK) {
+				std::cout << "Accept failed, errno " << errno << ": " << strerror(errno) << std::endl;
+			}
+			return;
+		}
+		
+		if(free_middlemen.empty()) {
+			// Out of middlemen. Drop this one and stop accepting until enough
+			// connections have closed, instead of spinning on the listen socket.
+			close(connect_sock);
+			shed_connections++;
+			stop_accepting("out of middlemen");
+			return;
+		}
+		
+		// Hand the connection to an idle middleman
+		connection_middleman * middleman = free_middlemen.back();
+		free_middlemen.pop_back();
 		opened_connections++;
-		new connection_middleman(listen_socket, address, addr_len, work, this, conf);
+		open_connections++;
+		middleman->start(connect_sock, client_addr);
 	}
 }
 
-connection_mother::~connection_mother()
+void connection_loop::stop_accepting(const char *reason) {
+	listen_event.stop();
+	if(!overloaded) {
+		overloaded = true;
+		std::cout << "No longer accepting connections: " << reason << std::endl;
+	}
+}
+
+// Called by a middleman when its connection is closed
+void connection_loop::release_middleman(connection_middleman * middleman) {
+	open_connections--;
+	free_middlemen.push_back(middleman);
+	if(overloaded && open_connections < low_water_connections) {
+		overloaded = false;
+		accept_retry.stop();
+		listen_event.start();
+		std::cout << "Accepting connections again" << std::endl;
+	}
+}
+
+// Listens again without leaving the overloaded state, so if descriptors are
+// still short the next accept stops the watcher again without logging
+void connection_loop::handle_accept_retry(ev::timer &watcher, int events_flags) {
+	if(overloaded && !free_middlemen.empty()) {
+		listen_event.start();
+	}
+}
+
+// Called by a pool thread when it has the response for middleman
+void connection_loop::complete(connection_middleman * middleman) {
+	while(!completed.push(middleman)) {}
+	completion_event.send();
+}
+
+// Send the responses the pool has finished. Several completions can be
+// folded into one wakeup, so empty the whole queue.
+void connection_loop::handle_completion(ev::async &watcher, int events_flags) {
+	connection_middleman * middleman;
+	while(completed.pop(middleman)) {
+		middleman->start_response();
+	}
+}
+
+connection_loop::~connection_loop()
 {
 	close(listen_socket);
+	for(unsigned int i = 0; i < middlemen.size(); i++) {
+		delete middlemen[i];
+	}
 }
 
 
@@ -91,92 +259,303 @@ connection_mother::~connection_mother()
 
 
 
-//---------- Connection middlemen - these little guys live until their connection is closed
+//---------- Connection middlemen - these little guys are created by their loop and
+// reused for one connection after another. Their read buffer is allocated only once.
 
-connection_middleman::connection_middleman(int &listen_socket, sockaddr_in &address, socklen_t &addr_len, worker * new_work, connection_mother * mother_arg, config * config_obj) : 
-	conf(config_obj), mother (mother_arg), work(new_work) {
-	
-	connect_sock = accept(listen_socket, (sockaddr *) &address, &addr_len);
-	if(connect_sock == -1) {
-		std::cout << "Accept failed, errno " << errno << ": " << strerror(errno) << std::endl;
-		mother->increment_open_connections(); // destructor decrements open connections
-		delete this;
-		return;
-	}
-	
-	// Set non-blocking
-	int flags = fcntl(connect_sock, F_GETFL);
-	if(flags == -1) {
-		std::cout << "Could not get connect socket flags" << std::endl;
-	}
-	if(fcntl(connect_sock, F_SETFL, flags | O_NONBLOCK) == -1) {
-		std::cout << "Could not set non-blocking" << std::endl;
-	}
-	
-	// Get their info
-	if(getpeername(connect_sock, (sockaddr *) &client_addr, &addr_len) == -1) {
-		//std::cout << "Could not get client info" << std::endl;
-	}
+connection_middleman::connection_middleman(worker * new_work, connection_loop * mother_arg, config * config_obj) : 
+	connect_sock(-1), read_event(mother_arg->get_loop()), write_event(mother_arg->get_loop()), timeout_event(mother_arg->get_loop()),
+	request_start(0), read_end(0), scan_pos(0), line_breaks(0), request(NULL), request_length(0), iov_index(0), iov_count(0), keep_alive(false), conf(config_obj), mother (mother_arg), work(new_work) {
 	
+	read_buffer = new char[conf->max_read_buffer];
 	
 	read_event.set<connection_middleman, &connection_middleman::handle_read>(this);
+	write_event.set<connection_middleman, &connection_middleman::handle_write>(this);
+	timeout_event.set<connection_middleman, &connection_middleman::handle_timeout>(this);
+}
+
+// Take over a newly accepted, non-blocking connection
+void connection_middleman::start(int sock, sockaddr_in &address) {
+	connect_sock = sock;
+	client_addr = address;
+	
 	read_event.start(connect_sock, ev::READ);
 	
-	// Let the socket timeout in timeout_interval seconds
-	timeout_event.set<connection_middleman, &connection_middleman::handle_timeout>(this);
+	// Let the socket timeout in timeout_interval seconds. Idle keep-alive
+	// connections get the same timeout after every response.
 	timeout_event.set(conf->timeout_interval, 0);
 	timeout_event.start();
-	
-	mother->increment_open_connections();
 }
 
-connection_middleman::~connection_middleman() {
+// Close the connection and go back to the loop's pool of idle middlemen
+void connection_middleman::close_connection() {
+	read_event.stop();
+	write_event.stop();
+	timeout_event.stop();
 	close(connect_sock);
-	mother->decrement_open_connections();
+	connect_sock = -1;
+	request_start = read_end = scan_pos = line_breaks = 0;
+	keep_alive = false;
+	response.clear();
+	mother->release_middleman(this);
+}
+
+connection_middleman::~connection_middleman() {
+	if(connect_sock != -1) {
+		close(connect_sock);
+	}
+	delete[] read_buffer;
+}
+
+static const char http_header[] = "HTTP/1.1 200 OK\r\nServer: Ocelot 1.0\r\nContent-Type: text/plain\r\n";
+static const char close_header[] = "Connection: close\r\n\r\n";
+
+// Whether the client wants the connection kept open after this request.
+// HTTP/1.1 defaults to keep-alive, HTTP/1.0 has to ask for it.
+static bool wants_keep_alive(const char *request, size_t header_end) {
+	const char *end = request + header_end;
+	const char *line_end = static_cast<const char *>(memchr(request, '\n', header_end));
+	if(line_end == NULL) {
+		return false;
+	}
+	const char *version_end = line_end;
+	if(version_end > request && *(version_end - 1) == '\r') {
+		version_end--;
+	}
+	if(version_end - request < 8) {
+		return false;
+	}
+	const char *version = version_end - 8;
+	bool keep_alive = memcmp(version, "HTTP/1.1", 8) == 0;
+	
+	for(const char *pos = line_end + 1; pos < end; pos = line_end + 1) {
+		line_end = static_cast<const char *>(memchr(pos, '\n', end - pos));
+		if(line_end == NULL) {
+			line_end = end;
+		}
+		if(line_end - pos > 11 && strncasecmp(pos, "connection:", 11) == 0) {
+			for(const char *c = pos + 11; c < line_end; c++) {
+				if(*c == 'c' || *c == 'C') {
+					keep_alive = false;
+					break;
+				} else if(*c == 'k' || *c == 'K') {
+					keep_alive = true;
+					break;
+				}
+			}
+		}
+	}
+	return keep_alive;
 }
 
 // Handler to read data from the socket, called by event loop when socket is readable
 void connection_middleman::handle_read(ev::io &watcher, int events_flags) {
-	read_event.stop();
+	// Make room behind the unfinished request, if any
+	if(read_end == conf->max_read_buffer && request_start > 0) {
+		memmove(read_buffer, read_buffer + request_start, read_end - request_start);
+		scan_pos -= request_start;
+		read_end -= request_start;
+		request_start = 0;
+	}
+	if(read_end == conf->max_read_buffer) {
+		// Way too long to be a tracker request
+		close_connection();
+		return;
+	}
 	
-	char buffer[conf->max_read_buffer + 1];
-	memset(buffer, 0, conf->max_read_buffer + 1);
-	int status = recv(connect_sock, &buffer, conf->max_read_buffer, 0);
+	int status = recv(connect_sock, read_buffer + read_end, conf->max_read_buffer - read_end, 0);
 	
-	if(status == -1) {
-		delete this;
+	if(status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	}
+	if(status <= 0) {
+		close_connection();
 		return;
 	}
+	read_end += status;
+	
+	// If the headers aren't complete yet, wait for the rest of the request
+	process_request();
+}
+
+// Look for the blank line ending the header block, carrying on from where
+// the last read stopped. \r is ignored so both \r\n\r\n and \n\n end it.
+bool connection_middleman::find_header_end() {
+	for(; scan_pos < read_end; scan_pos++) {
+		char c = read_buffer[scan_pos];
+		if(c == '\n') {
+			if(++line_breaks == 2) {
+				scan_pos++;
+				return true;
+			}
+		} else if(c != '\r') {
+			line_breaks = 0;
+		}
+	}
+	return false;
+}
+
+// Hand the first complete request in read_buffer to the worker.
+// Returns false if no complete request has arrived yet.
+bool connection_middleman::process_request() {
+	if(!find_header_end()) {
+		return false;
+	}
+	read_event.stop();
 	
-	std::string stringbuf = buffer;
+	// The request stays where it is in read_buffer until the response is
+	// sent, since nothing is read while it's being worked on
+	request = read_buffer + request_start;
+	request_length = scan_pos - request_start;
+	request_start = scan_pos;
+	line_breaks = 0;
+	if(request_start == read_end) {
+		request_start = scan_pos = read_end = 0;
+	}
+	keep_alive = wants_keep_alive(request, request_length);
 	
-	char ip[INET_ADDRSTRLEN];
-	inet_ntop(AF_INET, &(client_addr.sin_addr), ip, INET_ADDRSTRLEN);
-	std::string ip_str = ip;
+	worker_pool * pool = mother->get_pool();
+	if(pool != NULL) {
+		// Nothing can close the connection while a pool thread has it
+		timeout_event.stop();
+		pool->submit(this, work->request_shard(request, request_length));
+		return true;
+	}
 	
 	//--- CALL WORKER
-	response = work->work(stringbuf, ip_str);
+	response.clear();
+	work->work(request, request_length, client_addr.sin_addr.s_addr, response);
+	start_response();
+	return true;
+}
+
+// Runs on a pool thread
+void connection_middleman::run_request() {
+	response.clear();
+	work->work(request, request_length, client_addr.sin_addr.s_addr, response);
+	mother->complete(this);
+}
+
+// Start sending the response to the request that was just worked on
+void connection_middleman::start_response() {
+	if(!timeout_event.is_active()) {
+		timeout_event.set(conf->timeout_interval, 0);
+		timeout_event.start();
+	}
+	
+	// The status line and fixed headers are never copied, only the
+	// connection headers and the body change per response
+	response_iov[0].iov_base = const_cast<char *>(http_header);
+	response_iov[0].iov_len = sizeof(http_header) - 1;
+	if(keep_alive) {
+		int length = snprintf(connection_header, sizeof(connection_header), "Connection: keep-alive\r\nContent-Length: %zu\r\n\r\n", response.size());
+		response_iov[1].iov_base = connection_header;
+		response_iov[1].iov_len = length;
+	} else {
+		response_iov[1].iov_base = const_cast<char *>(close_header);
+		response_iov[1].iov_len = sizeof(close_header) - 1;
+	}
+	response_iov[2].iov_base = const_cast<char *>(response.data());
+	response_iov[2].iov_len = response.size();
+	iov_index = 0;
+	iov_count = response.empty() ? 2 : 3;
 	
 	// Find out when the socket is writeable. 
 	// The loop in connection_mother will call handle_write when it is. 
-	write_event.set<connection_middleman, &connection_middleman::handle_write>(this);
 	write_event.start(connect_sock, ev::WRITE);
 }
 
-// Handler to write data to the socket, called by event loop when socket is writeable
+// Handler to write data to the socket, called by event loop when socket is writeable.
+// Stays on the write watcher until the whole response has gone out.
 void connection_middleman::handle_write(ev::io &watcher, int events_flags) {
+	while(iov_index < iov_count) {
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = response_iov + iov_index;
+		msg.msg_iovlen = iov_count - iov_index;
+		ssize_t sent = sendmsg(connect_sock, &msg, MSG_NOSIGNAL);
+		if(sent == -1) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				return;
+			}
+			close_connection();
+			return;
+		}
+		
+		// Skip past whatever was sent
+		while(iov_index < iov_count && static_cast<size_t>(sent) >= response_iov[iov_index].iov_len) {
+			sent -= response_iov[iov_index].iov_len;
+			iov_index++;
+		}
+		if(iov_index < iov_count) {
+			response_iov[iov_index].iov_base = static_cast<char *>(response_iov[iov_index].iov_base) + sent;
+			response_iov[iov_index].iov_len -= sent;
+		}
+	}
+	
 	write_event.stop();
 	timeout_event.stop();
-	std::string http_response = "HTTP/1.1 200 OK\r\nServer: Ocelot 1.0\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n";
-	http_response+=response;
-	send(connect_sock, http_response.c_str(), http_response.size(), MSG_NOSIGNAL);
-	delete this;
+	if(!keep_alive) {
+		close_connection();
+		return;
+	}
+	
+	// Keep the connection around for the next request, which may already
+	// be waiting in the buffer if the client pipelines.
+	response.clear();
+	timeout_event.set(conf->timeout_interval, 0);
+	timeout_event.start();
+	if(!process_request()) {
+		read_event.start(connect_sock, ev::READ);
+	}
 }
 
 // After a middleman has been alive for timout_interval seconds, this is called
 void connection_middleman::handle_timeout(ev::timer &watcher, int events_flags) {
-	timeout_event.stop();
-	read_event.stop();
-	write_event.stop();
-	delete this;
+	close_connection();
+}
+
+
+
+
+
+
+
+//---------- Worker pool - threads that call the worker so the loops don't have to
+
+worker_pool::worker_pool(unsigned int num_threads, size_t queue_size) : next_thread(0) {
+	for(unsigned int i = 0; i < num_threads; i++) {
+		threads.push_back(new pool_thread(queue_size));
+	}
+	for(unsigned int i = 0; i < num_threads; i++) {
+		boost::thread thread(&worker_pool::run, this, threads[i]);
+	}
+}
+
+// Requests for the same torrent shard go to the same thread, so its lock is
+// rarely contended. Anything else is handed out in turn.
+void worker_pool::submit(connection_middleman * middleman, int shard) {
+	unsigned int index = shard >= 0 ? shard : next_thread++;
+	pool_thread * thread = threads[index % threads.size()];
+	while(!thread->requests.push(middleman)) {}
+	if(thread->sleeping) {
+		boost::mutex::scoped_lock lock(thread->lock);
+		thread->wake.notify_one();
+	}
+}
+
+void worker_pool::run(pool_thread * thread) {
+	connection_middleman * middleman;
+	for(;;) {
+		if(!thread->requests.pop(middleman)) {
+			// Check the queue again after saying we're going to sleep, so a
+			// request that was pushed in between isn't missed
+			boost::mutex::scoped_lock lock(thread->lock);
+			thread->sleeping = true;
+			while(!thread->requests.pop(middleman)) {
+				thread->wake.wait(lock);
+			}
+			thread->sleeping = false;
+		}
+		middleman->run_request();
+	}
 }
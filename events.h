@@ -1,12 +1,19 @@
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <vector>
+#include <atomic>
 
 // libev
 #include <ev++.h>
 
+#include <boost/lockfree/queue.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
 // Sockets
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 
@@ -25,11 +32,16 @@ TODO find out what these do
 
 
 /*
-We have three classes - the mother, the middlemen, and the worker
+We have three classes - the mother, the middlemen, and the worker, and
+optionally a pool of threads running the worker
 THE MOTHER
 	The mother is called when a client opens a connection to the server. 
-	It creates a middleman for every new connection, which will be called
-	when its socket is ready for reading.
+	It hands every new connection to an idle middleman from its pool, which
+	will be called when its socket is ready for reading.
+	The mother runs io_threads event loops. Each loop has its own listen
+	socket (SO_REUSEPORT lets the kernel spread connections across them),
+	its own middlemen and its own timers. Loop 0 runs in the main thread
+	and also owns the schedule timer.
 THE MIDDLEMEN
 	Each middleman hang around until data is written to its socket. It then
 	reads the data and sends it to the worker. When it gets the response, it
@@ -39,40 +51,96 @@ THE WORKER
 	doesn't concern itself with silly things like sockets. 
 	
 	see worker.h for the worker.
+THE POOL
+	With worker_threads set, middlemen don't call the worker themselves.
+	They queue their request for a pool thread, which calls the worker and
+	queues the middleman back on its loop to send the response. Announces
+	for a torrent shard always go to the same pool thread.
 */
 
 
 
 
-// THE MOTHER - Spawns connection middlemen
-class connection_mother {
+class connection_mother;
+class connection_middleman;
+class worker_pool;
+
+// One event loop with its own listen socket. Middlemen live on the loop that accepted them.
+class connection_loop {
 	private:
 		int listen_socket;
 		sockaddr_in address;
-		socklen_t addr_len;
+		worker * work;
+		config * conf;
+		worker_pool * pool;
+		ev::dynamic_loop loop;
+		ev::io listen_event;
+		
+		// Middlemen whose request the pool has finished, see complete()
+		boost::lockfree::queue<connection_middleman *> completed;
+		ev::async completion_event;
+		
+		// Every middleman this loop owns, and the ones not serving a connection
+		std::vector<connection_middleman *> middlemen;
+		std::vector<connection_middleman *> free_middlemen;
+		
+		// Set while the listen watcher is stopped because every middleman is
+		// busy, or the process is out of file descriptors or memory
+		bool overloaded;
+		unsigned int low_water_connections;
+		ev::timer accept_retry; // Resumes accepting after running out of descriptors
+		void stop_accepting(const char *reason);
+		
+		// Written by this loop only, read by the schedule on loop 0
+		std::atomic<unsigned long> opened_connections;
+		std::atomic<unsigned int> open_connections;
+		std::atomic<unsigned long> shed_connections;
+		
+	public:
+		connection_loop(worker * worker_obj, config * config_obj, worker_pool * pool_obj);
+		
+		void release_middleman(connection_middleman * middleman);
+		
+		worker_pool * get_pool() { return pool; }
+		// Called from pool threads
+		void complete(connection_middleman * middleman);
+		void handle_completion(ev::async &watcher, int events_flags);
+		
+		unsigned int get_open_connections() { return open_connections; }
+		unsigned long get_opened_connections() { return opened_connections; }
+		unsigned long get_shed_connections() { return shed_connections; }
+		
+		ev::loop_ref get_loop() { return loop; }
+		
+		void handle_connect(ev::io &watcher, int events_flags);
+		void handle_accept_retry(ev::timer &watcher, int events_flags);
+		void run();
+		~connection_loop();
+};
+
+// THE MOTHER - Spawns connection loops, which spawn connection middlemen
+class connection_mother {
+	private:
 		worker * work;
 		config * conf;
 		mysql * db;
 		ev::timer schedule_event;
-		
-		unsigned long opened_connections;
-		unsigned int open_connections;
+		std::vector<connection_loop *> loops;
+		worker_pool * pool;
 		
 	public: 
 		connection_mother(worker * worker_obj, config * config_obj, mysql * db_obj);
 		
-		void increment_open_connections() { open_connections++; }
-		void decrement_open_connections() { open_connections--; }
-		
-		int get_open_connections() { return open_connections; }
-		int get_opened_connections() { return opened_connections; }
+		int get_open_connections();
+		int get_opened_connections();
+		unsigned long get_shed_connections();
 
-		void handle_connect(ev::io &watcher, int events_flags);
 		~connection_mother();
 };
 
 // THE MIDDLEMAN
-// Created by connection_mother
+// Created by connection_loop when it starts and kept in its pool, serves
+// one connection at a time on that loop
 // Add their own watchers to see when sockets become readable
 class connection_middleman {
 	private:
@@ -80,22 +148,71 @@ class connection_middleman {
 		ev::io read_event;
 		ev::io write_event;
 		ev::timer timeout_event;
+		
+		// Requests are read into read_buffer and parsed in place.
+		// [request_start, read_end) holds unprocessed bytes, scan_pos is how far
+		// the search for the end of the current request's headers has got.
+		char * read_buffer;
+		unsigned int request_start;
+		unsigned int read_end;
+		unsigned int scan_pos;
+		unsigned int line_breaks;
+		
+		// Response headers and body are sent with one sendmsg from response_iov.
+		// iov_index is the first entry that hasn't been fully sent.
 		std::string response;
+		const char * request; // The request being worked on
+		size_t request_length;
+		char connection_header[64];
+		iovec response_iov[3];
+		int iov_index;
+		int iov_count;
+		bool keep_alive;
 		
 		config * conf;
-		connection_mother * mother;
+		connection_loop * mother;
 		worker * work;
 		sockaddr_in client_addr;
 	
 	public:
-		connection_middleman(int &listen_socket, sockaddr_in &address, socklen_t &addr_len, worker* work, connection_mother * mother_arg, config * config_obj);
+		connection_middleman(worker* work, connection_loop * mother_arg, config * config_obj);
 		~connection_middleman();
+		
+		void start(int sock, sockaddr_in &address);
+		void close_connection();
 	
+		bool find_header_end();
+		bool process_request();
+		void run_request();
+		void start_response();
 		void handle_read(ev::io &watcher, int events_flags);
 		void handle_write(ev::io &watcher, int events_flags);
 		void handle_timeout(ev::timer &watcher, int events_flags);
 };
 
-
-
-
+// THE POOL - Threads that call the worker for middlemen, so a slow request
+// doesn't hold up every other connection on a loop
+class worker_pool {
+	private:
+		class pool_thread {
+			public:
+				boost::lockfree::queue<connection_middleman *> requests;
+				// Only used to sleep when there's nothing to do
+				boost::mutex lock;
+				boost::condition_variable wake;
+				std::atomic<bool> sleeping;
+				
+				pool_thread(size_t queue_size) : requests(queue_size), sleeping(false) {}
+		};
+		
+		std::vector<pool_thread *> threads;
+		std::atomic<unsigned int> next_thread;
+		
+		void run(pool_thread * thread);
+	
+	public:
+		worker_pool(unsigned int num_threads, size_t queue_size);
+		
+		// shard is the request's torrent shard, or -1 to pick any thread
+		void submit(connection_middleman * middleman, int shard);
+};
@@ -0,0 +1,56 @@
+#ifndef OCELOT_EXPIRY_WHEEL_H
+#define OCELOT_EXPIRY_WHEEL_H
+
+#include <vector>
+#include <stdint.h>
+
+// Timing wheel of entries that are due at some tick. Ticks are absolute
+// (time / tick length), the wheel only has buckets for span ticks ahead, so
+// entries that are due later go into the last bucket and are expected to be
+// re-added when they come up. Nothing is ever removed early: whoever takes
+// the entries checks whether they still apply.
+template<class Entry> class expiry_wheel {
+	private:
+		std::vector<std::vector<Entry> > buckets;
+		uint32_t next_tick; // First tick that hasn't been taken yet
+
+	public:
+		expiry_wheel() : next_tick(0) {}
+
+		void init(uint32_t span, uint32_t now_tick) {
+			buckets.resize(span + 2);
+			next_tick = now_tick;
+		}
+
+		// Returns the tick the entry was actually put in
+		uint32_t add(uint32_t tick, const Entry &entry) {
+			if(tick < next_tick) {
+				tick = next_tick;
+			} else if(tick >= next_tick + buckets.size()) {
+				tick = next_tick + buckets.size() - 1;
+			}
+			buckets[tick % buckets.size()].push_back(entry);
+			return tick;
+		}
+
+		// Swaps the entries of the next tick before now_tick into due, which
+		// should be empty. Returns false once every past tick has been taken.
+		bool take_due(uint32_t now_tick, std::vector<Entry> &due, uint32_t &tick) {
+			if(next_tick >= now_tick) {
+				return false;
+			}
+			tick = next_tick++;
+			due.swap(buckets[tick % buckets.size()]);
+			return true;
+		}
+
+		size_t size() const {
+			size_t n = 0;
+			for(size_t i = 0; i < buckets.size(); i++) {
+				n += buckets[i].size();
+			}
+			return n;
+		}
+};
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef OCELOT_FLAT_MAP_H
+#define OCELOT_FLAT_MAP_H
+
+#include <vector>
+#include <array>
+#include <utility>
+#include <cstring>
+#include <stdint.h>
+
+// Hash for keys that are already uniformly distributed, like infohashes.
+// The first 8 bytes of the key are used as they are.
+template<size_t N> struct fixed_key_hash {
+	size_t operator()(const std::array<uint8_t, N> &key) const {
+		uint64_t hash;
+		memcpy(&hash, key.data(), sizeof(hash));
+		return hash;
+	}
+};
+
+// Hash for keys that share long prefixes, like peer ids, whose first 8 bytes
+// are usually the client and its version. Every byte of the key is mixed in,
+// 8 at a time, the last word overlapping the one before if N isn't a multiple
+// of 8.
+template<size_t N> struct mixed_key_hash {
+	size_t operator()(const std::array<uint8_t, N> &key) const {
+		static_assert(N >= 8, "mixed_key_hash needs keys of at least 8 bytes");
+		uint64_t hash = 0, word;
+		for(size_t i = 0; i < N; i += 8) {
+			memcpy(&word, key.data() + (i + 8 <= N ? i : N - 8), sizeof(word));
+			hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+			hash ^= hash >> 29;
+		}
+		// Finalizer from MurmurHash3, the index only uses the low bits
+		hash ^= hash >> 33;
+		hash *= 0xff51afd7ed558ccdULL;
+		hash ^= hash >> 33;
+		hash *= 0xc4ceb9fe1a85ec53ULL;
+		hash ^= hash >> 33;
+		return hash;
+	}
+};
+
+// Open addressing (linear probing) index from fixed-size keys to positions
+// in a dense array kept by the caller. Slots hold the key and the position,
+// so a lookup touches one or two cache lines. Deletion shifts the following
+// entries back instead of leaving tombstones.
+template<class Key, class Hash> class flat_index {
+	private:
+		typedef struct {
+			Key key;
+			uint32_t pos;
+		} slot;
+
+		// Empty until the first insert, as most indexes (the peer lists of
+		// inactive torrents) never get one
+		std::vector<slot> slots;
+		uint32_t mask;
+		uint32_t used;
+		Hash hasher;
+
+		size_t find_slot(const Key &key) const {
+			size_t i = hasher(key) & mask;
+			while(slots[i].pos != npos && slots[i].key != key) {
+				i = (i + 1) & mask;
+			}
+			return i;
+		}
+
+		void grow() {
+			std::vector<slot> old_slots;
+			old_slots.swap(slots);
+			slots.resize(old_slots.empty() ? 16 : old_slots.size() * 2);
+			mask = slots.size() - 1;
+			for(size_t i = 0; i < slots.size(); i++) {
+				slots[i].pos = npos;
+			}
+			for(size_t i = 0; i < old_slots.size(); i++) {
+				if(old_slots[i].pos != npos) {
+					slots[find_slot(old_slots[i].key)] = old_slots[i];
+				}
+			}
+		}
+
+	public:
+		static const uint32_t npos = 0xFFFFFFFF;
+
+		flat_index() : mask(0), used(0) {}
+
+		// Position of key, or npos
+		uint32_t find(const Key &key) const {
+			if(used == 0) {
+				return npos;
+			}
+			return slots[find_slot(key)].pos;
+		}
+
+		// Adds key, or moves it if it's already there
+		void insert(const Key &key, uint32_t pos) {
+			// Keep the load factor under 0.75
+			if((used + 1) * 4 > slots.size() * 3) {
+				grow();
+			}
+			size_t i = find_slot(key);
+			if(slots[i].pos == npos) {
+				slots[i].key = key;
+				used++;
+			}
+			slots[i].pos = pos;
+		}
+
+		bool erase(const Key &key) {
+			if(used == 0) {
+				return false;
+			}
+			size_t i = find_slot(key);
+			if(slots[i].pos == npos) {
+				return false;
+			}
+			// Shift back every following entry that would no longer be reachable
+			size_t j = i;
+			for(;;) {
+				j = (j + 1) & mask;
+				if(slots[j].pos == npos) {
+					break;
+				}
+				size_t home = hasher(slots[j].key) & mask;
+				if((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+					slots[i] = slots[j];
+					i = j;
+				}
+			}
+			slots[i].pos = npos;
+			used--;
+			return true;
+		}
+
+		void reserve(size_t n) {
+			while(n * 4 > slots.size() * 3) {
+				grow();
+			}
+		}
+
+		void clear() {
+			std::vector<slot>().swap(slots);
+			mask = 0;
+			used = 0;
+		}
+
+		size_t size() const { return used; }
+		size_t memory_usage() const { return slots.capacity() * sizeof(slot); }
+};
+
+// Hash map with fixed-size keys. Entries are stored contiguously and found
+// through a flat_index. Erasing moves the last entry into the hole, so
+// iterators and references are only valid until the next insert or erase.
+template<class Key, class Value, class Hash> class flat_map {
+	private:
+		std::vector<std::pair<Key, Value> > entries;
+		flat_index<Key, Hash> index;
+
+	public:
+		typedef typename std::vector<std::pair<Key, Value> >::iterator iterator;
+		typedef typename std::vector<std::pair<Key, Value> >::const_iterator const_iterator;
+
+		iterator begin() { return entries.begin(); }
+		iterator end() { return entries.end(); }
+		const_iterator begin() const { return entries.begin(); }
+		const_iterator end() const { return entries.end(); }
+
+		iterator find(const Key &key) {
+			uint32_t pos = index.find(key);
+			return pos == flat_index<Key, Hash>::npos ? entries.end() : entries.begin() + pos;
+		}
+
+		Value &operator[](const Key &key) {
+			uint32_t pos = index.find(key);
+			if(pos == flat_index<Key, Hash>::npos) {
+				pos = entries.size();
+				entries.push_back(std::pair<Key, Value>(key, Value()));
+				index.insert(key, pos);
+			}
+			return entries[pos].second;
+		}
+
+		void erase(iterator it) {
+			index.erase(it->first);
+			if(it + 1 != entries.end()) {
+				*it = std::move(entries.back());
+				index.insert(it->first, it - entries.begin());
+			}
+			entries.pop_back();
+		}
+
+		size_t erase(const Key &key) {
+			iterator it = find(key);
+			if(it == entries.end()) {
+				return 0;
+			}
+			erase(it);
+			return 1;
+		}
+
+		void reserve(size_t n) {
+			entries.reserve(n);
+			index.reserve(n);
+		}
+
+		size_t size() const { return entries.size(); }
+		bool empty() const { return entries.empty(); }
+		size_t memory_usage() const { return entries.capacity() * sizeof(std::pair<Key, Value>) + index.memory_usage(); }
+};
+
+#endif
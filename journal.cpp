@@ -0,0 +1,320 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "journal.h"
+
+// A record is its header followed by the job: the number of statements, then
+// each statement, the infile's LOAD clause and the infile data as length and bytes.
+// Records that were only partly written before a crash fail the checksum.
+#define JOURNAL_MAGIC 0x314a434f // "OCJ1"
+#define JOURNAL_HEADER 12 // Magic, payload length, payload checksum
+#define ACK_SIZE 16 // Segment, offset, checksum of both
+
+static uint32_t checksum(const char *data, size_t length) {
+	uint32_t hash = 2166136261u; // FNV-1a
+	for(size_t i = 0; i < length; i++) {
+		hash = (hash ^ static_cast<uint8_t>(data[i])) * 16777619u;
+	}
+	return hash;
+}
+
+static void put32(std::string &out, uint32_t value) {
+	out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static void put_string(std::string &out, const std::string &value) {
+	put32(out, value.size());
+	out += value;
+}
+
+static bool get32(const char *&p, const char *end, uint32_t &value) {
+	if(end - p < static_cast<ptrdiff_t>(sizeof(value))) {
+		return false;
+	}
+	memcpy(&value, p, sizeof(value));
+	p += sizeof(value);
+	return true;
+}
+
+static bool get_string(const char *&p, const char *end, std::string &value) {
+	uint32_t length;
+	if(!get32(p, end, length) || static_cast<size_t>(end - p) < length) {
+		return false;
+	}
+	value.assign(p, length);
+	p += length;
+	return true;
+}
+
+static std::string encode(const flush_job &job) {
+	std::string payload;
+	put32(payload, job.statements.size());
+	for(size_t i = 0; i < job.statements.size(); i++) {
+		put_string(payload, job.statements[i]);
+	}
+	put_string(payload, job.infile_into);
+	put_string(payload, job.infile_data);
+
+	std::string record;
+	record.reserve(JOURNAL_HEADER + payload.size());
+	put32(record, JOURNAL_MAGIC);
+	put32(record, payload.size());
+	put32(record, checksum(payload.data(), payload.size()));
+	record += payload;
+	return record;
+}
+
+// Decodes the record at the start of data, returning its length or 0 if it
+// isn't a whole, valid record
+static size_t decode(const char *data, size_t length, flush_job &job) {
+	const char *p = data, *end = data + length;
+	uint32_t magic, payload_length, sum, statements;
+	if(!get32(p, end, magic) || !get32(p, end, payload_length) || !get32(p, end, sum)
+		|| magic != JOURNAL_MAGIC || static_cast<size_t>(end - p) < payload_length
+		|| checksum(p, payload_length) != sum) {
+		return 0;
+	}
+	end = p + payload_length;
+	if(!get32(p, end, statements)) {
+		return 0;
+	}
+	job.statements.resize(statements);
+	for(uint32_t i = 0; i < statements; i++) {
+		if(!get_string(p, end, job.statements[i])) {
+			return 0;
+		}
+	}
+	if(!get_string(p, end, job.infile_into) || !get_string(p, end, job.infile_data)) {
+		return 0;
+	}
+	return end - data;
+}
+
+flush_journal::flush_journal(const std::string &dir, const std::string &name, uint64_t max_segment_size) :
+	prefix(dir + "/" + name), segment_size(max_segment_size), segment(0), fd(-1), offset(0), unsynced(false),
+	ack_fd(-1), acked_segment(0), acked_offset(0), ack_unsaved(false) {
+	if(mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+		std::cerr << "Could not create journal directory " << dir << ": " << strerror(errno) << std::endl;
+	}
+}
+
+flush_journal::~flush_journal() {
+	if(fd != -1) {
+		close(fd);
+	}
+	if(ack_fd != -1) {
+		close(ack_fd);
+	}
+}
+
+std::string flush_journal::segment_path(uint32_t n) {
+	std::ostringstream path;
+	path << prefix << '.' << n;
+	return path.str();
+}
+
+bool flush_journal::open_segment(uint32_t n) {
+	if(fd != -1) {
+		if(unsynced) {
+			fdatasync(fd);
+		}
+		close(fd);
+	}
+	segment = n;
+	offset = 0;
+	unsynced = false;
+	fd = open(segment_path(n).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if(fd == -1) {
+		std::cerr << "Could not open journal " << segment_path(n) << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+	// Make sure the new file itself survives a crash
+	std::string dir = prefix.substr(0, prefix.rfind('/'));
+	int dir_fd = open(dir.c_str(), O_RDONLY);
+	if(dir_fd != -1) {
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+	return true;
+}
+
+// A torn or missing ack file means nothing is known to be acknowledged
+void flush_journal::load_ack() {
+	std::string path = prefix + ".ack";
+	ack_fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	if(ack_fd == -1) {
+		std::cerr << "Could not open journal " << path << ": " << strerror(errno) << std::endl;
+		return;
+	}
+	char data[ACK_SIZE];
+	const char *p = data, *end = data + ACK_SIZE;
+	uint32_t low, high, sum;
+	if(pread(ack_fd, data, ACK_SIZE, 0) == ACK_SIZE && get32(p, end, acked_segment) && get32(p, end, low)
+		&& get32(p, end, high) && get32(p, end, sum) && checksum(data, ACK_SIZE - 4) == sum) {
+		acked_offset = (static_cast<uint64_t>(high) << 32) | low;
+	} else {
+		acked_segment = 0;
+		acked_offset = 0;
+	}
+}
+
+// Overwrites the one record in place, which a single small pwrite does whole
+bool flush_journal::save_ack() {
+	if(ack_fd == -1) {
+		return false;
+	}
+	std::string data;
+	put32(data, acked_segment);
+	put32(data, acked_offset & 0xFFFFFFFF);
+	put32(data, acked_offset >> 32);
+	put32(data, checksum(data.data(), data.size()));
+	if(pwrite(ack_fd, data.data(), data.size(), 0) != ACK_SIZE || fdatasync(ack_fd) != 0) {
+		std::cerr << "Could not write journal " << prefix << ".ack: " << strerror(errno) << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Checks every record of the segment, one at a time
+bool flush_journal::read_segment(uint32_t n, std::vector<journal_position> &positions) {
+	std::ifstream file(segment_path(n).c_str(), std::ios::in | std::ios::binary);
+	std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	size_t pos = 0, found = 0;
+	while(pos < data.size()) {
+		flush_job job;
+		size_t length = decode(data.data() + pos, data.size() - pos, job);
+		if(length == 0) {
+			std::cerr << "Ignoring " << (data.size() - pos) << " bytes of unreadable journal in " << segment_path(n) << std::endl;
+			break;
+		}
+		// Skip what the last run already got into MySQL
+		if(n > acked_segment || (n == acked_segment && pos + length > acked_offset)) {
+			journal_position position = { n, pos, static_cast<uint32_t>(length) };
+			positions.push_back(position);
+			found++;
+		}
+		pos += length;
+	}
+	if(found > 0) {
+		pending[n] = found;
+	}
+	return found > 0;
+}
+
+void flush_journal::replay(std::vector<journal_position> &positions) {
+	std::string dir = prefix.substr(0, prefix.rfind('/'));
+	std::string name = prefix.substr(prefix.rfind('/') + 1) + '.';
+	std::vector<uint32_t> segments;
+	DIR *d = opendir(dir.c_str());
+	if(d != NULL) {
+		struct dirent *entry;
+		while((entry = readdir(d)) != NULL) {
+			std::string file = entry->d_name;
+			if(file.compare(0, name.size(), name) == 0 && file.size() > name.size()
+				&& file.find_first_not_of("0123456789", name.size()) == std::string::npos) {
+				segments.push_back(strtoul(file.c_str() + name.size(), NULL, 10));
+			}
+		}
+		closedir(d);
+	}
+	std::sort(segments.begin(), segments.end());
+	load_ack();
+	for(size_t i = 0; i < segments.size(); i++) {
+		if(!read_segment(segments[i], positions)) {
+			unlink(segment_path(segments[i]).c_str());
+		}
+	}
+	// Past the acknowledged segment too, or new jobs would count as acknowledged
+	uint32_t next = acked_segment + 1;
+	if(!segments.empty()) {
+		next = std::max(next, segments.back() + 1);
+	}
+	open_segment(next);
+}
+
+bool flush_journal::append(const flush_job &job, journal_position &position) {
+	if(offset >= segment_size) {
+		open_segment(segment + 1);
+	}
+	if(fd == -1) {
+		return false;
+	}
+	std::string record = encode(job);
+	size_t written = 0;
+	while(written < record.size()) {
+		ssize_t n = write(fd, record.data() + written, record.size() - written);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n <= 0) {
+			std::cerr << "Could not write journal " << segment_path(segment) << ": " << strerror(errno) << std::endl;
+			// Don't leave half a record in front of the next one
+			if(ftruncate(fd, offset) != 0) {
+				open_segment(segment + 1);
+			}
+			return false;
+		}
+		written += n;
+	}
+	position.segment = segment;
+	position.offset = offset;
+	position.length = record.size();
+	offset += record.size();
+	pending[segment]++;
+	unsynced = true;
+	return true;
+}
+
+bool flush_journal::sync() {
+	if(unsynced && fd != -1) {
+		if(fdatasync(fd) != 0) {
+			std::cerr << "Could not sync journal " << segment_path(segment) << ": " << strerror(errno) << std::endl;
+			return false;
+		}
+		unsynced = false;
+	}
+	if(ack_unsaved && save_ack()) {
+		ack_unsaved = false;
+	}
+	return !ack_unsaved;
+}
+
+void flush_journal::acknowledge(const journal_position &position) {
+	if(position.segment > acked_segment || (position.segment == acked_segment && position.offset + position.length > acked_offset)) {
+		acked_segment = position.segment;
+		acked_offset = position.offset + position.length;
+		ack_unsaved = true;
+	}
+	std::map<uint32_t, size_t>::iterator it = pending.find(position.segment);
+	if(it == pending.end() || --it->second > 0) {
+		return;
+	}
+	pending.erase(it);
+	// Appending at the start of an emptied segment would put new jobs behind
+	// the acknowledged offset, so a new one is started instead
+	if(position.segment == segment) {
+		open_segment(segment + 1);
+	}
+	unlink(segment_path(position.segment).c_str());
+}
+
+// Doesn't touch the journal's state, so it's safe next to appends
+bool flush_journal::read(const journal_position &position, flush_job &job) {
+	int read_fd = open(segment_path(position.segment).c_str(), O_RDONLY);
+	if(read_fd == -1) {
+		return false;
+	}
+	std::string data(position.length, '\0');
+	ssize_t n = pread(read_fd, &data[0], position.length, position.offset);
+	close(read_fd);
+	return n == static_cast<ssize_t>(position.length) && decode(data.data(), data.size(), job) == position.length;
+}
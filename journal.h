@@ -0,0 +1,63 @@
+#ifndef OCELOT_JOURNAL_H
+#define OCELOT_JOURNAL_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include "bulk_writer.h"
+
+// Where a job was written in a journal
+typedef struct {
+	uint32_t segment;
+	uint64_t offset;
+	uint32_t length; // Of the whole record
+} journal_position;
+
+// Append-only log of the jobs a flush_stream hasn't run yet, so they survive
+// a crash or restart and don't all have to be kept in memory. It's split in
+// numbered segment files, prefix.0, prefix.1 and so on. A segment is removed
+// once every job in it has been acknowledged, and if it's the one being
+// appended to, a new segment is started. Appends are only made durable by
+// sync, so several can share one fdatasync.
+// Jobs are acknowledged in the order they were appended, so the end of the
+// last one acknowledged is all replay needs to skip the jobs MySQL already
+// took. It's kept in prefix.ack and written by sync along with the appends,
+// so a crash can only run the jobs acknowledged since the last sync twice.
+// Not locked, the flush_stream using it does that.
+class flush_journal {
+	private:
+		std::string prefix;
+		uint64_t segment_size; // Start a new segment once one is this large
+		uint32_t segment; // The one being appended to
+		int fd; // Of segment
+		uint64_t offset; // End of segment
+		std::map<uint32_t, size_t> pending; // Unacknowledged jobs per segment
+		bool unsynced;
+		int ack_fd; // Of prefix.ack
+		uint32_t acked_segment; // Everything before acked_offset in acked_segment,
+		uint64_t acked_offset; // and in every segment before it, is acknowledged
+		bool ack_unsaved;
+
+		std::string segment_path(uint32_t n);
+		bool open_segment(uint32_t n);
+		void load_ack();
+		bool save_ack();
+		bool read_segment(uint32_t n, std::vector<journal_position> &positions);
+
+	public:
+		flush_journal(const std::string &dir, const std::string &name, uint64_t max_segment_size);
+		~flush_journal();
+
+		// Finds the jobs left by the last run, oldest first, and starts a
+		// new segment after them. Only their positions are kept, the jobs
+		// are read back with read. Call once, before anything else.
+		void replay(std::vector<journal_position> &positions);
+		bool append(const flush_job &job, journal_position &position);
+		bool sync();
+		bool synced() { return !unsynced && !ack_unsaved; }
+		void acknowledge(const journal_position &position);
+		bool read(const journal_position &position, flush_job &job);
+};
+
+#endif
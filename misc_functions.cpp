@@ -1,6 +1,22 @@
 #include <string>
 #include <iostream>
 #include <sstream>
+#include <cstdio>
+#include <climits>
+#include <boost/utility/string_ref.hpp>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+static int hex_value(char c) {
+	if(c >= '0' && c <= '9') {
+		return c - '0';
+	} else if(c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	} else if(c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
 
 long strtolong(const std::string& str) {
 	std::istringstream stream (str);
@@ -16,6 +32,30 @@ long long strtolonglong(const std::string& str) {
 	return i;
 }
 
+// Parses a decimal number straight from a request view. Like the stream
+// versions above it stops at the first non-digit, and numbers that don't
+// fit are clamped to LLONG_MAX or LLONG_MIN.
+long long strtolonglong(const boost::string_ref &str) {
+	long long i = 0;
+	size_t pos = 0;
+	bool negative = false;
+	if(pos < str.size() && (str[pos] == '-' || str[pos] == '+')) {
+		negative = str[pos] == '-';
+		pos++;
+	}
+	for(; pos < str.size() && str[pos] >= '0' && str[pos] <= '9'; pos++) {
+		int digit = str[pos] - '0';
+		if(i > (LLONG_MAX - digit) / 10) {
+			return negative ? LLONG_MIN : LLONG_MAX;
+		}
+		i = i * 10 + digit;
+	}
+	return negative ? -i : i;
+}
+
+long strtolong(const boost::string_ref &str) {
+	return strtolonglong(str);
+}
 
 std::string inttostr(const int i) {
 	std::string str;
@@ -25,7 +65,14 @@ std::string inttostr(const int i) {
 	return str;
 }
 
-std::string hex_decode(const std::string &in) {
+// Like inttostr, without making a string of its own
+void append_int(std::string &out, long long i) {
+	char buf[24];
+	int length = snprintf(buf, sizeof(buf), "%lld", i);
+	out.append(buf, length);
+}
+
+std::string hex_decode(const boost::string_ref &in) {
 	std::string out;
 	out.reserve(20);
 	unsigned int in_length = in.length();
@@ -56,3 +103,60 @@ std::string hex_decode(const std::string &in) {
 	}
 	return out;
 }
+
+// Url decodes into a fixed-size key, true if it came out exactly length bytes long
+bool hex_decode(const boost::string_ref &in, uint8_t *out, size_t length) {
+	size_t out_pos = 0;
+	unsigned int in_length = in.length();
+	for(unsigned int i = 0; i < in_length; i++) {
+		if(out_pos == length) {
+			return false;
+		}
+		if(in[i] == '%' && (i + 2) < in_length) {
+			int high = hex_value(in[i + 1]), low = hex_value(in[i + 2]);
+			if(high < 0 || low < 0) {
+				return false;
+			}
+			out[out_pos++] = static_cast<uint8_t>((high << 4) | low);
+			i += 2;
+		} else {
+			out[out_pos++] = static_cast<uint8_t>(in[i]);
+		}
+	}
+	return out_pos == length;
+}
+
+// Plain hex (passkeys) to binary, true if in was exactly length * 2 hex digits
+bool hex_to_bin(const boost::string_ref &in, uint8_t *out, size_t length) {
+	if(in.length() != length * 2) {
+		return false;
+	}
+	for(size_t i = 0; i < length; i++) {
+		int high = hex_value(in[i * 2]), low = hex_value(in[i * 2 + 1]);
+		if(high < 0 || low < 0) {
+			return false;
+		}
+		out[i] = static_cast<uint8_t>((high << 4) | low);
+	}
+	return true;
+}
+
+std::string bin_to_hex(const uint8_t *in, size_t length) {
+	static const char digits[] = "0123456789abcdef";
+	std::string out;
+	out.reserve(length * 2);
+	for(size_t i = 0; i < length; i++) {
+		out.push_back(digits[in[i] >> 4]);
+		out.push_back(digits[in[i] & 0xF]);
+	}
+	return out;
+}
+
+// Dotted quad for an IPv4 address in network byte order
+std::string ip_to_string(uint32_t ip) {
+	char str[INET_ADDRSTRLEN];
+	in_addr addr;
+	addr.s_addr = ip;
+	inet_ntop(AF_INET, &addr, str, INET_ADDRSTRLEN);
+	return str;
+}
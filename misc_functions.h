@@ -2,10 +2,19 @@
 #define MISC_FUNCTIONS__H
 #include <string>
 #include <cstdlib>
+#include <stdint.h>
+#include <boost/utility/string_ref.hpp>
 long strtolong(const std::string& str);
 long long strtolonglong(const std::string& str);
+long strtolong(const boost::string_ref &str);
+long long strtolonglong(const boost::string_ref &str);
 std::string inttostr(int i);
-std::string hex_decode(const std::string &in);
+void append_int(std::string &out, long long i);
+std::string hex_decode(const boost::string_ref &in);
+bool hex_decode(const boost::string_ref &in, uint8_t *out, size_t length);
+bool hex_to_bin(const boost::string_ref &in, uint8_t *out, size_t length);
+std::string bin_to_hex(const uint8_t *in, size_t length);
+std::string ip_to_string(uint32_t ip);
 int timeval_subtract (timeval* result, timeval* x, timeval* y);
 
 #endif
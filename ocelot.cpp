@@ -21,6 +21,12 @@ static void sig_handler(int sig)
 	}
 }
 
+// Only flags the report, the schedule prints it outside the signal handler
+static void memory_report_handler(int sig)
+{
+	work->request_memory_report();
+}
+
 int main() {
 	config conf;
 
@@ -29,8 +35,11 @@ int main() {
 
 	log_ptr = new logger("debug.log");
 
-	mysql db(conf.mysql_db, conf.mysql_host, conf.mysql_username, conf.mysql_password);
+	mysql db(conf.mysql_db, conf.mysql_host, conf.mysql_username, conf.mysql_password, conf.flush_mode, conf.max_statement_size);
 	db_ptr = &db;
+	if(!conf.journal_dir.empty()) {
+		db.open_journals(conf.journal_dir, conf.flush_memory_budget);
+	}
 
 	site_comm sc(conf);
 	sc_ptr = &sc;
@@ -42,11 +51,11 @@ int main() {
 		std::cout << "Assuming no blacklist desired, disabling" << std::endl;
 	}
 	
-	std::unordered_map<std::string, user> users_list;
+	user_list users_list;
 	db.load_users(users_list);
 	std::cout << "Loaded " << users_list.size() << " users" << std::endl;
 	
-	std::unordered_map<std::string, torrent> torrents_list;
+	torrent_store torrents_list;
 	db.load_torrents(torrents_list);
 	std::cout << "Loaded " << torrents_list.size() << " torrents" << std::endl;
         
@@ -57,7 +66,9 @@ int main() {
         db.load_site_options(site_options);
         
 	// Create worker object, which handles announces and scrapes and all that jazz
+	// It takes over the torrent and user lists instead of copying them
 	work = new worker(site_options, torrents_list, users_list, blacklist, &conf, &db, sc);
+	signal(SIGUSR1, memory_report_handler); // kill -USR1 prints torrent memory usage
 	
 	// Create connection mother, which binds to its socket and handles the event stuff
 	mother = new connection_mother(work, &conf, &db);
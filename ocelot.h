@@ -3,29 +3,19 @@
 #include <vector>
 #include <unordered_map>
 #include <set>
+#include <array>
+#include <memory>
+#include <stdint.h>
 #include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include "flat_map.h"
+#include "peer_list.h"
+#include "expiry_wheel.h"
 
 typedef struct {
     time_t freeleech;
 } site_options_t;
 
-typedef struct {
-	int userid;
-	std::string peer_id;
-	std::string user_agent;
-	std::string ip_port;
-	std::string ip;
-	unsigned int port;
-	long long uploaded;
-	long long downloaded;
-	uint64_t left;
-	time_t last_announced;
-	time_t first_announced;
-	unsigned int announces;
-} peer;
-
-typedef std::map<std::string, peer> peer_list;
-
 enum freetype { NORMAL, FREE, NEUTRAL };
 
 typedef struct {
@@ -33,20 +23,42 @@ typedef struct {
     time_t double_seed;
 } slots_t;
 
+typedef std::map<int, slots_t> token_map;
+
+// A torrent's peers and what goes with them. Most torrents have no peers at
+// any time, so this is only allocated while they do, see worker::expire_peers.
 typedef struct {
-	int id;
+	peer_list seeders;
+	peer_list leechers;
+	size_t next_seeder; // Where the next leecher's seeder list starts
+	size_t next_leecher; // Where the next leecher list starts
 	time_t last_seeded;
-	long long balance;
+	time_t last_flushed;
+} torrent_swarm;
+
+// Only the counters are kept inline, so an idle torrent is one cache line.
+// Few torrents have tokens, so the token map is kept out of line and only
+// allocated when the first is added.
+typedef struct {
+	int id;
 	int completed;
+	long long balance;
 	freetype free_torrent;
-        bool double_seed;
-	std::map<std::string, peer> seeders;
-	std::map<std::string, peer> leechers;
-	std::string last_selected_seeder;
-	std::map<int, slots_t> tokened_users;
-	time_t last_flushed;
+	bool double_seed;
+	bool dirty; // In its shard's dirty_torrents, waiting to be written
+	int pending_snatches; // Snatches since it was last written
+	std::unique_ptr<torrent_swarm> swarm; // NULL if the torrent has no peers
+	std::unique_ptr<token_map> tokened_users; // NULL if the torrent has no tokens
 } torrent;
 
+inline size_t seeder_count(const torrent &tor) {
+	return tor.swarm ? tor.swarm->seeders.size() : 0;
+}
+
+inline size_t leecher_count(const torrent &tor) {
+	return tor.swarm ? tor.swarm->leechers.size() : 0;
+}
+
 typedef struct {
 	int id;
 	bool can_leech;
@@ -54,6 +66,62 @@ typedef struct {
         int pmid;
 } user;
 
+// Infohashes are 20 raw bytes, passkeys 32 hex characters stored as 16 bytes
+typedef std::array<uint8_t, 20> infohash_t;
+typedef std::array<uint8_t, 16> passkey_t;
+
+typedef flat_map<infohash_t, torrent, fixed_key_hash<20> > torrent_list;
+
+// Number of torrent_store shards, must be a power of 2
+#define TORRENT_SHARDS 64
+
+// A peer that may have timed out, see worker::expire_peers
+typedef struct {
+	infohash_t info_hash;
+	peerid_t peer_id;
+} peer_expiry;
+
+typedef struct {
+	boost::mutex lock;
+	torrent_list torrents;
+	expiry_wheel<peer_expiry> expiry;
+	std::vector<infohash_t> dirty_torrents; // See worker::flush_torrents
+	char padding[64]; // Keep neighbouring locks off each other's cache lines
+} torrent_shard;
+
+// Torrents split by infohash into shards with a lock each, so announces for
+// different torrents rarely wait for each other and peer expiry only blocks
+// one shard at a time. The shard comes from the last byte of the infohash,
+// while torrent_list hashes the first bytes.
+class torrent_store {
+	private:
+		std::unique_ptr<torrent_shard[]> shards;
+
+	public:
+		torrent_store() : shards(new torrent_shard[TORRENT_SHARDS]) {}
+
+		torrent_shard &shard(size_t i) { return shards[i]; }
+		static size_t shard_index(const infohash_t &info_hash) {
+			return info_hash[info_hash.size() - 1] & (TORRENT_SHARDS - 1);
+		}
+		torrent_shard &shard_for(const infohash_t &info_hash) {
+			return shards[shard_index(info_hash)];
+		}
+
+		// Spreads n torrents over the shards, with some slack for uneven ones
+		void reserve(size_t n) {
+			for(size_t i = 0; i < TORRENT_SHARDS; i++) {
+				shards[i].torrents.reserve(n / TORRENT_SHARDS + n / (TORRENT_SHARDS * 8) + 1);
+			}
+		}
 
-typedef std::unordered_map<std::string, torrent> torrent_list;
-typedef std::unordered_map<std::string, user> user_list;
+		// Not locked, only exact when nothing else is running
+		size_t size() {
+			size_t n = 0;
+			for(size_t i = 0; i < TORRENT_SHARDS; i++) {
+				n += shards[i].torrents.size();
+			}
+			return n;
+		}
+};
+typedef flat_map<passkey_t, user, fixed_key_hash<16> > user_list;
@@ -0,0 +1,133 @@
+#ifndef OCELOT_PEER_LIST_H
+#define OCELOT_PEER_LIST_H
+
+#include <string>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <ctime>
+#include <stdint.h>
+#include "flat_map.h"
+
+typedef std::array<uint8_t, 20> peerid_t;
+
+typedef struct {
+	int userid;
+	peerid_t peer_id;
+	uint16_t user_agent; // Id in the user agent string_table, see db.h
+	uint32_t ip; // Network byte order
+	unsigned int port;
+	long long uploaded;
+	long long downloaded;
+	uint64_t left;
+	time_t last_announced;
+	time_t first_announced;
+	unsigned int announces;
+	uint32_t expiry_tick; // The tick of the peer's current entry in its shard's expiry wheel
+} peer;
+
+// The seeders or leechers of a torrent. Peers are kept in a dense array,
+// found by peer id through a flat_index, and removed by moving the last
+// peer into the hole. Their compact ip/port strings are kept in the same
+// order in one contiguous string, so a peer list for an announce is built
+// from a couple of appends. That string is the list's pre-serialized blob:
+// it's kept up to date by every change, and announces copy a window of it
+// that moves with the torrent's rotation cursors, so no other cache of
+// peer windows is kept. Positions and peer pointers are only valid until
+// the next insert or erase.
+class peer_list {
+	private:
+		std::vector<peer> peers;
+		std::string endpoints; // 6 bytes per peer: ip, then port, in network order
+		flat_index<peerid_t, mixed_key_hash<20> > index;
+
+	public:
+		static const size_t npos = flat_index<peerid_t, mixed_key_hash<20> >::npos;
+
+		size_t size() const { return peers.size(); }
+		bool empty() const { return peers.empty(); }
+
+		peer &operator[](size_t pos) { return peers[pos]; }
+		const peer &operator[](size_t pos) const { return peers[pos]; }
+
+		// Position of the peer, or npos
+		size_t find(const peerid_t &peer_id) const {
+			return index.find(peer_id);
+		}
+
+		size_t position(const peer *p) const {
+			return p - &peers[0];
+		}
+
+		// Adds a peer with an empty endpoint, and returns its position
+		size_t insert(const peerid_t &peer_id, const peer &p) {
+			size_t pos = peers.size();
+			peers.push_back(p);
+			peers.back().peer_id = peer_id;
+			endpoints.append(6, '\0');
+			index.insert(peer_id, pos);
+			return pos;
+		}
+
+		void erase_at(size_t pos) {
+			index.erase(peers[pos].peer_id);
+			size_t last = peers.size() - 1;
+			if(pos != last) {
+				peers[pos] = std::move(peers[last]);
+				endpoints.replace(pos * 6, 6, endpoints, last * 6, 6);
+				index.insert(peers[pos].peer_id, pos);
+			}
+			peers.pop_back();
+			endpoints.resize(last * 6);
+		}
+
+		bool erase(const peerid_t &peer_id) {
+			size_t pos = find(peer_id);
+			if(pos == npos) {
+				return false;
+			}
+			erase_at(pos);
+			return true;
+		}
+
+		const char *endpoint(size_t pos) const {
+			return endpoints.data() + pos * 6;
+		}
+
+		void set_endpoint(size_t pos, const char *ip_port) {
+			endpoints.replace(pos * 6, 6, ip_port, 6);
+		}
+
+		// Appends the endpoints of count peers starting at start, wrapping
+		// around to the beginning of the list
+		void append_endpoints(std::string &out, size_t start, size_t count) const {
+			size_t first = std::min(count, peers.size() - start);
+			out.append(endpoints, start * 6, first * 6);
+			if(count > first) {
+				out.append(endpoints, 0, (count - first) * 6);
+			}
+		}
+
+		// As above, but leaves out the peer at skip (npos for none). At most
+		// size() - 1 peers can be appended if skip is in the list.
+		void append_endpoints(std::string &out, size_t start, size_t count, size_t skip) const {
+			if(skip == npos) {
+				append_endpoints(out, start, count);
+				return;
+			}
+			// How far into the window the skipped peer is
+			size_t offset = skip >= start ? skip - start : skip + peers.size() - start;
+			if(offset >= count) {
+				append_endpoints(out, start, count);
+				return;
+			}
+			append_endpoints(out, start, offset);
+			append_endpoints(out, (skip + 1) % peers.size(), count - offset);
+		}
+
+		size_t memory_usage() const {
+			return peers.capacity() * sizeof(peer) + endpoints.capacity() + index.memory_usage();
+		}
+};
+
+#endif
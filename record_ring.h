@@ -0,0 +1,54 @@
+#ifndef OCELOT_RECORD_RING_H
+#define OCELOT_RECORD_RING_H
+
+#include <vector>
+#include <atomic>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <boost/thread/mutex.hpp>
+
+// Records from one thread to the flush, which is the only reader. Pushing is
+// lock free while the ring has room. Once it's full, records go into an
+// overflow vector under a lock until the next drain has emptied both, so a
+// drain still sees every thread's records in the order they were pushed.
+template<class Record> class record_ring {
+	private:
+		boost::lockfree::spsc_queue<Record> ring;
+		std::vector<Record> overflow;
+		std::atomic<bool> spilled;
+		boost::mutex overflow_lock;
+
+	public:
+		explicit record_ring(size_t capacity) : ring(capacity), spilled(false) {}
+
+		void push(const Record &record) {
+			if(!spilled.load(std::memory_order_acquire) && ring.push(record)) {
+				return;
+			}
+			boost::mutex::scoped_lock lock(overflow_lock);
+			overflow.push_back(record);
+			spilled.store(true, std::memory_order_release);
+		}
+
+		// Reader only, appends everything pushed so far to out
+		void drain(std::vector<Record> &out) {
+			Record record;
+			while(ring.pop(record)) {
+				out.push_back(record);
+			}
+			boost::mutex::scoped_lock lock(overflow_lock);
+			out.insert(out.end(), overflow.begin(), overflow.end());
+			overflow.clear();
+			spilled.store(false, std::memory_order_release);
+		}
+
+		// Reader only
+		bool empty() {
+			if(ring.read_available() > 0) {
+				return false;
+			}
+			boost::mutex::scoped_lock lock(overflow_lock);
+			return overflow.empty();
+		}
+};
+
+#endif
@@ -10,7 +10,7 @@ schedule::schedule(connection_mother * mother_obj, worker* worker_obj, config* c
 	counter = 0;
 	last_opened_connections = 0;
 	
-	next_reap_peers = time(NULL) + conf->reap_peers_interval + 40;
+	expired_peers = 0;
 }
 //---------- Schedule - gets called every schedule_interval seconds
 void schedule::handle(ev::timer &watcher, int events_flags) {
@@ -26,23 +26,31 @@ void schedule::handle(ev::timer &watcher, int events_flags) {
 		strftime (buffer,80,"%Y-%m-%d %X",timeinfo);
 		std::cout << buffer << " Schedule run #" << counter << " - open: " << mother->get_open_connections() << ", opened: " 
 		<< mother->get_opened_connections() << ", speed: "
-		<< ((mother->get_opened_connections()-last_opened_connections)/conf->schedule_interval) << "/s" << std::endl;
+		<< ((mother->get_opened_connections()-last_opened_connections)/conf->schedule_interval) << "/s, shed: "
+		<< mother->get_shed_connections() << ", expired peers: " << expired_peers << std::endl;
+		expired_peers = 0;
+		work->print_update_stats();
 	}
 
-	if ((work->get_status() == CLOSING) && db->all_clear()) {
-		std::cout << "all clear, shutting down" << std::endl;
-		exit(0);
+	// Walking every torrent takes a while, so it's only done on request
+	if (work->take_memory_report()) {
+		work->print_memory_usage();
 	}
 
 	last_opened_connections = mother->get_opened_connections();
 	
-	db->flush();
+	expired_peers += work->expire_peers();
 
-	time_t cur_time = time(NULL);
+	// After expiry, so the torrent rows have this run's peer counts
+	work->flush_torrents();
+	bool closing = work->get_status() == CLOSING;
+	// The flush itself runs on the database's own thread
+	db->request_flush(closing);
 
-	if(cur_time > next_reap_peers) {
-		work->reap_peers();
-		next_reap_peers = cur_time + conf->reap_peers_interval;
+	// Set by a closing flush of an earlier run
+	if (closing && db->all_clear()) {
+		std::cout << "all clear, shutting down" << std::endl;
+		exit(0);
 	}
 
 	counter++;
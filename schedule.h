@@ -12,7 +12,7 @@ class schedule {
 		int counter;
 		
 		time_t next_flush;
-		time_t next_reap_peers;
+		unsigned long expired_peers;
 	public:
 		schedule(connection_mother * mother_obj, worker * worker_obj, config* conf_obj, mysql * db_obj);
 		void handle(ev::timer &watcher, int events_flags);
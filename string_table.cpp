@@ -0,0 +1,60 @@
+#include <iostream>
+#include <algorithm>
+#include <boost/thread/locks.hpp>
+#include "string_table.h"
+
+string_table::string_table(size_t max_strings_arg, size_t max_length_arg, size_t max_per_owner_arg, const std::string &other_string) :
+	max_strings(std::min<size_t>(max_strings_arg, 0xFFFF)), max_length(max_length_arg), max_per_owner(max_per_owner_arg), full_reported(false) {
+	strings.push_back(std::string());
+	ids[boost::string_ref(strings.back())] = 0;
+	strings.push_back(other_string);
+	ids[boost::string_ref(strings.back())] = 1;
+}
+
+string_id string_table::intern(const boost::string_ref &full_str, int owner) {
+	boost::string_ref str = full_str;
+	if(str.size() > max_length) {
+		// Don't leave half a UTF-8 character at the end
+		size_t length = max_length;
+		while(length > 0 && (static_cast<uint8_t>(str[length]) & 0xC0) == 0x80) {
+			length--;
+		}
+		str = str.substr(0, length);
+	}
+	boost::mutex::scoped_lock lock(table_lock);
+	std::unordered_map<boost::string_ref, string_id, ref_hash>::const_iterator it = ids.find(str);
+	if(it != ids.end()) {
+		return it->second;
+	}
+	if(strings.size() >= max_strings) {
+		if(!full_reported) {
+			std::cout << "String table is full (" << strings.size() << " strings), new strings will be stored as " << strings[1] << std::endl;
+			full_reported = true;
+		}
+		return 1;
+	}
+	size_t &added = owner_counts[owner];
+	if(added >= max_per_owner) {
+		if(added == max_per_owner) {
+			std::cout << "User " << owner << " added " << added << " strings, their new ones will be stored as " << strings[1] << std::endl;
+			added++;
+		}
+		return 1;
+	}
+	added++;
+	string_id id = strings.size();
+	strings.push_back(str.to_string());
+	ids[boost::string_ref(strings.back())] = id;
+	return id;
+}
+
+// The string itself is never changed or moved, so the reference stays valid
+const std::string &string_table::get(string_id id) {
+	boost::mutex::scoped_lock lock(table_lock);
+	return strings[id];
+}
+
+size_t string_table::size() {
+	boost::mutex::scoped_lock lock(table_lock);
+	return strings.size();
+}
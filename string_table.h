@@ -0,0 +1,46 @@
+#ifndef OCELOT_STRING_TABLE_H
+#define OCELOT_STRING_TABLE_H
+
+#include <string>
+#include <deque>
+#include <unordered_map>
+#include <stdint.h>
+#include <boost/utility/string_ref.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread/mutex.hpp>
+
+typedef uint16_t string_id;
+
+// Interned strings, for values that are repeated across many peers like
+// user agents. Each distinct string is stored once and given a small id.
+// Id 0 is the empty string. Strings are cut to max_length bytes, at a UTF-8
+// character boundary. Clients pick these strings, so the table is kept from
+// filling up: once it holds max_strings, or an owner (a user) has added
+// max_per_owner of them, new strings get id 1, which is other_string.
+class string_table {
+	private:
+		struct ref_hash {
+			size_t operator()(const boost::string_ref &str) const {
+				return boost::hash_range(str.begin(), str.end());
+			}
+		};
+
+		// strings never moves its elements, so the keys of ids can point into it
+		std::deque<std::string> strings;
+		std::unordered_map<boost::string_ref, string_id, ref_hash> ids;
+		std::unordered_map<int, size_t> owner_counts; // Strings added per owner
+		size_t max_strings;
+		size_t max_length;
+		size_t max_per_owner;
+		bool full_reported;
+		boost::mutex table_lock;
+
+	public:
+		string_table(size_t max_strings_arg, size_t max_length_arg, size_t max_per_owner_arg, const std::string &other_string);
+
+		string_id intern(const boost::string_ref &str, int owner);
+		const std::string &get(string_id id);
+		size_t size();
+};
+
+#endif
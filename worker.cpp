@@ -7,6 +7,8 @@
 #include <vector>
 #include <set>
 #include <algorithm>
+#include <cstring>
+#include <ctime>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -27,8 +29,47 @@
 
 //---------- Worker - does stuff with input
 
-worker::worker(site_options_t &options, torrent_list &torrents, user_list &users, std::vector<std::string> &_blacklist, config * conf_obj, mysql * db_obj, site_comm &sc) : site_options(options), torrents_list(torrents), users_list(users), blacklist(_blacklist), conf(conf_obj), db(db_obj), s_comm(sc) {
+// Store an announce parameter if it's one we use
+static void set_announce_param(announce_params &params, const boost::string_ref &key, const boost::string_ref &value) {
+	switch(key.size()) {
+		case 2:
+			if(key == "ip") params.ip = value;
+			break;
+		case 4:
+			if(key == "port") params.port = value;
+			else if(key == "left") params.left = value;
+			else if(key == "ipv4") params.ipv4 = value;
+			break;
+		case 5:
+			if(key == "event") params.event = value;
+			break;
+		case 7:
+			if(key == "peer_id") params.peer_id = value;
+			else if(key == "numwant") params.numwant = value;
+			else if(key == "compact") params.compact = value;
+			else if(key == "corrupt") params.corrupt = value;
+			break;
+		case 8:
+			if(key == "uploaded") params.uploaded = value;
+			break;
+		case 9:
+			if(key == "info_hash") params.info_hash = value;
+			break;
+		case 10:
+			if(key == "downloaded") params.downloaded = value;
+			break;
+	}
+}
+
+worker::worker(site_options_t &options, torrent_store &torrents, user_list &users, std::vector<std::string> &_blacklist, config * conf_obj, mysql * db_obj, site_comm &sc) : site_options(options), torrents_list(std::move(torrents)), users_list(std::move(users)), blacklist(_blacklist), conf(conf_obj), db(db_obj), s_comm(sc) {
 	status = OPEN;
+	memory_report = false;
+	memset(update_stats, 0, sizeof(update_stats));
+	uint32_t now_tick = time(NULL) / conf->schedule_interval;
+	for(size_t s = 0; s < TORRENT_SHARDS; s++) {
+		torrents_list.shard(s).expiry.init(conf->peers_timeout / conf->schedule_interval, now_tick);
+	}
+	print_memory_usage();
 }
 bool worker::signal(int sig) {
 	if (status == OPEN) {
@@ -42,31 +83,29 @@ bool worker::signal(int sig) {
 		return false;
 	}
 }
-std::string worker::work(std::string &input, std::string &ip) {
-	unsigned int input_length = input.length();
-	
+// ip is the client's IPv4 address in network byte order
+// The response is appended to output
+void worker::work(const char *input, unsigned int input_length, uint32_t ip, std::string &output) {
 	//---------- Parse request - ugly but fast. Using substr exploded.
 	if(input_length < 60) { // Way too short to be anything useful
-		return error("GET string too short");
+		return error("GET string too short", output);
 	}
 	
 	size_t pos = 5; // skip GET /
 	
 	// Get the passkey
-	std::string passkey;
-	passkey.reserve(32);
 	if(input[37] != '/') {
 		// robots.txt requested?
-		if(input[11] == '.')
-			return "User-agent: *\nDisallow: /";
+		if(input[11] == '.') {
+			output += "User-agent: *\nDisallow: /";
+			return;
+		}
 
 		//std::cout << "Malformed Announce: " << input;
-		return error("Malformed announce");
+		return error("Malformed announce", output);
 	} 
 	
-	for(; pos < 37; pos++) {
-		passkey.push_back(input[pos]);
-	}
+	boost::string_ref passkey(input + pos, 32);
 	
 	pos = 38;
 	
@@ -91,75 +130,67 @@ std::string worker::work(std::string &input, std::string &ip) {
 			break;
 	}
 	if(action == INVALID) {
-		std::cout << "Invalid action: " << input;
-		return error("invalid action");
+		std::cout << "Invalid action: " << std::string(input, input_length);
+		return error("invalid action", output);
 	}
 
 	if ((status != OPEN) && (action != UPDATE)) {
-		return error("The tracker is temporarily unavailable.");
+		return error("The tracker is temporarily unavailable.", output);
 	}
 	
-	// Parse URL params
+	// Parse URL params. Values stay url encoded and point into the input buffer,
+	// and announces only keep the keys they know, so nothing gets allocated.
 	std::list<std::string> infohashes; // For scrape only
+	std::map<std::string, std::string> update_params; // For update only
+	announce_params params; // For announce only
 	
-	std::map<std::string, std::string> params;
-	std::string key;
-	std::string value;
-	bool parsing_key = true; // true = key, false = value
-	
+	const char *key = input + pos;
+	const char *value = NULL;
 	for(; pos < input_length; ++pos) {
-		if(input[pos] == '=') {
-			parsing_key = false;
+		if(input[pos] == '=' && value == NULL) {
+			value = input + pos + 1;
 		} else if(input[pos] == '&' || input[pos] == ' ') {
-			parsing_key = true;
-			if(action == SCRAPE && key == "info_hash") {
-				infohashes.push_back(value);
+			boost::string_ref key_ref, value_ref;
+			if(value == NULL) {
+				key_ref = boost::string_ref(key, input + pos - key);
 			} else {
-
-				params[key] = value;
+				key_ref = boost::string_ref(key, value - 1 - key);
+				value_ref = boost::string_ref(value, input + pos - value);
+			}
+			
+			if(action == ANNOUNCE) {
+				set_announce_param(params, key_ref, value_ref);
+			} else if(action == SCRAPE) {
+				if(key_ref == "info_hash") {
+					infohashes.push_back(value_ref.to_string());
+				}
+			} else {
+				update_params[key_ref.to_string()] = value_ref.to_string();
 			}
-			key.clear();
-			value.clear();
 			if(input[pos] == ' ') {
 				break;
 			}
-		} else {
-			if(parsing_key) {
-				key.push_back(input[pos]);
-			} else {
-				value.push_back(input[pos]);
-			}
+			key = input + pos + 1;
+			value = NULL;
 		}
 	}
 	
-	pos += 10; // skip HTTP/1.1 - should probably be +=11, but just in case a client doesn't send \r
-	
-	// Parse headers
-	std::map<std::string, std::string> headers;
-	parsing_key = true;
-	bool found_data = false;
-	
-	for(; pos < input_length; ++pos) {
-		if(input[pos] == ':') {
-			parsing_key = false;
-			++pos; // skip space after :
-		} else if(input[pos] == '\n' || input[pos] == '\r') {
-			parsing_key = true;
-			
-			if(found_data) {
-				found_data = false; // dodge for getting around \r\n or just \n
-				std::transform(key.begin(), key.end(), key.begin(), ::tolower);
-				headers[key] = value;
-				key.clear();
-				value.clear();
-			}
-		} else {
-			found_data = true;
-			if(parsing_key) {
-				key.push_back(input[pos]);
-			} else {
-				value.push_back(input[pos]);
+	// Parse headers. The user agent is the only one we use.
+	const char *input_end = input + input_length;
+	const char *line_end = static_cast<const char *>(memchr(input + pos, '\n', input_end - (input + pos)));
+	while(line_end != NULL) {
+		const char *line = line_end + 1;
+		line_end = static_cast<const char *>(memchr(line, '\n', input_end - line));
+		const char *end = line_end == NULL ? input_end : line_end;
+		if(end > line && *(end - 1) == '\r') {
+			end--;
+		}
+		if(end - line > 11 && strncasecmp(line, "user-agent:", 11) == 0) {
+			const char *agent = line + 11;
+			while(agent < end && *agent == ' ') {
+				agent++;
 			}
+			params.user_agent = boost::string_ref(agent, end - agent);
 		}
 	}
 	
@@ -167,54 +198,114 @@ std::string worker::work(std::string &input, std::string &ip) {
 	
 	if(action == UPDATE) {
 		if(passkey == conf->site_password) {
-			return update(params);
+			return update(update_params, output);
 		} else {
-			return error("Authentication failure");
+			return error("Authentication failure", output);
 		}
 	}
 	
 	// Either a scrape or an announce
 	
-	user_list::iterator u = users_list.find(passkey);
-	if(u == users_list.end()) {
-		return error("passkey not found");
+	// The user is copied so the users lock isn't held during the announce
+	passkey_t passkey_bin;
+	user u;
+	if(!hex_to_bin(passkey, passkey_bin.data(), passkey_bin.size())) {
+		return error("passkey not found", output);
+	}
+	{
+		boost::shared_lock<boost::shared_mutex> users_read_lock(users_lock);
+		user_list::iterator user_it = users_list.find(passkey_bin);
+		if(user_it == users_list.end()) {
+			return error("passkey not found", output);
+		}
+		u = user_it->second;
 	}
         
 	if(action == ANNOUNCE) {
-		boost::mutex::scoped_lock lock(db->torrent_list_mutex);
 		// Let's translate the infohash into something nice
 		// info_hash is a url encoded (hex) base 20 number
-		std::string info_hash_decoded = hex_decode(params["info_hash"]);
-		torrent_list::iterator tor = torrents_list.find(info_hash_decoded);
-		if(tor == torrents_list.end()) {
+		infohash_t info_hash;
+		if(!hex_decode(params.info_hash, info_hash.data(), info_hash.size())) {
+			return error("unregistered torrent", output);
+		}
+		torrent_shard &shard = torrents_list.shard_for(info_hash);
+		boost::mutex::scoped_lock shard_lock(shard.lock);
+		torrent_list::iterator tor = shard.torrents.find(info_hash);
+		if(tor == shard.torrents.end()) {
 			//std::cout << "Unregistered torrent: " << input;
- 			return error("unregistered torrent");
+ 			return error("unregistered torrent", output);
 		}
-		return announce(tor->second, u->second, params, headers, ip);
+		return announce(shard, info_hash, tor->second, u, params, ip, output);
 	} else {
-		return scrape(infohashes);
+		return scrape(infohashes, output);
+	}
+}
+
+// The torrent shard of the first info_hash in the request line, or -1 if
+// there is none. Only used to pick a pool thread, so it can be sloppy.
+int worker::request_shard(const char *input, unsigned int input_length) {
+	static const char key[] = "info_hash=";
+	const char *end = static_cast<const char *>(memchr(input, '\n', input_length));
+	if(end == NULL) {
+		end = input + input_length;
+	}
+	const char *pos = static_cast<const char *>(memmem(input, end - input, key, sizeof(key) - 1));
+	if(pos == NULL) {
+		return -1;
+	}
+	const char *value = pos + sizeof(key) - 1;
+	const char *value_end = value;
+	while(value_end < end && *value_end != '&' && *value_end != ' ') {
+		value_end++;
+	}
+	infohash_t info_hash;
+	if(!hex_decode(boost::string_ref(value, value_end - value), info_hash.data(), info_hash.size())) {
+		return -1;
 	}
+	return torrent_store::shard_index(info_hash);
 }
 
-std::string worker::error(std::string err) {
-	std::string output = "d14:failure reason";
-	output += inttostr(err.length());
+void worker::error(const char *err, std::string &output) {
+	output += "d14:failure reason";
+	append_int(output, strlen(err));
 	output += ':';
 	output += err;
 	output += 'e';
-	return output;
 }
 
-std::string worker::announce(torrent &tor, user &u, std::map<std::string, std::string> &params, std::map<std::string, std::string> &headers, std::string &ip){
+// Cycles through the leecher list like the seeder list, so every leecher gets
+// shown to other peers instead of the first few in the list. self is the
+// position of the announcing peer in the list, or npos.
+unsigned int worker::select_leechers(torrent_swarm &swarm, std::string &peers, unsigned int numwant, size_t self) {
+	size_t available = swarm.leechers.size() - (self != peer_list::npos ? 1 : 0);
+	size_t count = std::min<size_t>(numwant, available);
+	if(count == 0) {
+		return 0;
+	}
+	size_t start = swarm.next_leecher < swarm.leechers.size() ? swarm.next_leecher : 0;
+	swarm.leechers.append_endpoints(peers, start, count, self);
+	// The window covered one more position if it had to step over self
+	size_t covered = count;
+	if(self != peer_list::npos) {
+		size_t offset = self >= start ? self - start : self + swarm.leechers.size() - start;
+		if(offset < count) {
+			covered++;
+		}
+	}
+	swarm.next_leecher = (start + covered) % swarm.leechers.size();
+	return count;
+}
+
+void worker::announce(torrent_shard &shard, const infohash_t &info_hash, torrent &tor, user &u, announce_params &params, uint32_t ip, std::string &output) {
 	time_t cur_time = time(NULL);
 	
-	if(params["compact"] != "1") {
-		return error("Your client does not support compact announces");
+	if(params.compact != "1") {
+		return error("Your client does not support compact announces", output);
 	}
 	
-	long long left = strtolonglong(params["left"]);
-	long long uploaded = std::max(0ll, strtolonglong(params["uploaded"]));
-	long long downloaded = std::max(0ll, strtolonglong(params["downloaded"]));
+	long long left = strtolonglong(params.left);
+	long long uploaded = std::max(0ll, strtolonglong(params.uploaded));
+	long long downloaded = std::max(0ll, strtolonglong(params.downloaded));
 	
 	bool inserted = false; // If we insert the peer as opposed to update
 	bool update_torrent = false; // Whether or not we should update the torrent in the DB
@@ -224,61 +315,54 @@ std::string worker::announce(torrent &tor, user &u, std::map<std::string, std::s
         time_t now;
         time(&now);
 
-        std::map<std::string, std::string>::const_iterator peer_id_iterator = params.find("peer_id");
-	if(peer_id_iterator == params.end()) {
-		return error("no peer id");
+	if(params.peer_id.empty()) {
+		return error("no peer id", output);
+	}
+	peerid_t peer_id;
+	if(!hex_decode(params.peer_id, peer_id.data(), peer_id.size())) {
+		return error("Invalid peer id", output);
 	}
-	std::string peer_id = peer_id_iterator->second;
-	peer_id = hex_decode(peer_id);
 	
-	if(blacklist.size() > 0) {
-		bool found = false; // Found client in blacklist?
-		for(unsigned int i = 0; i < blacklist.size(); i++) {
-			if(peer_id.find(blacklist[i]) == 0) {
-				found = true;
-				break;
-			}
-		}
-
-		if(found) {
-			return error("Your client is blacklisted!");
+	// Updates can change the blacklist and site options at any time
+	boost::shared_lock<boost::shared_mutex> users_read_lock(users_lock);
+	time_t site_freeleech = site_options.freeleech;
+	bool blacklisted = false; // Found client in blacklist?
+	for(unsigned int i = 0; i < blacklist.size(); i++) {
+		if(blacklist[i].length() <= peer_id.size() && memcmp(peer_id.data(), blacklist[i].data(), blacklist[i].length()) == 0) {
+			blacklisted = true;
+			break;
 		}
 	}
+	users_read_lock.unlock();
+	
+	if(blacklisted) {
+		return error("Your client is blacklisted!", output);
+	}
 	
 	peer * p;
-	peer_list::iterator i;
+	peer_list * plist; // The list p is in
+	size_t i;
 	// Insert/find the peer in the torrent list
-	if(left > 0 || params["event"] == "completed") {
-		if(u.can_leech == false) {
-			return error("Access denied, leeching forbidden");
-		}
-		
-		i = tor.leechers.find(peer_id);
-		if(i == tor.leechers.end()) {
-			peer new_peer;
-			std::pair<peer_list::iterator, bool> insert 
-			= tor.leechers.insert(std::pair<std::string, peer>(peer_id, new_peer));
-			
-			p = &(insert.first->second);
-			inserted = true;
-		} else {
-			p = &i->second;
-		}
+	if((left > 0 || params.event == "completed") && u.can_leech == false) {
+		return error("Access denied, leeching forbidden", output);
+	}
+	if(!tor.swarm) {
+		tor.swarm.reset(new torrent_swarm());
+	}
+	torrent_swarm &swarm = *tor.swarm;
+	if(left > 0 || params.event == "completed") {
+		plist = &swarm.leechers;
 	} else {
-		i = tor.seeders.find(peer_id);
-		if(i == tor.seeders.end()) {
-			peer new_peer;
-			std::pair<peer_list::iterator, bool> insert 
-			= tor.seeders.insert(std::pair<std::string, peer>(peer_id, new_peer));
-			
-			p = &(insert.first->second);
-			inserted = true;
-		} else {
-			p = &i->second;
-		}
-		
-		tor.last_seeded = cur_time;
+		plist = &swarm.seeders;
+		swarm.last_seeded = cur_time;
 	}
+	i = plist->find(peer_id);
+	if(i == peer_list::npos) {
+		peer new_peer;
+		i = plist->insert(peer_id, new_peer);
+		inserted = true;
+	}
+	p = &(*plist)[i];
 	
 	// Update the peer
 	p->left = left;
@@ -288,12 +372,13 @@ std::string worker::announce(torrent &tor, user &u, std::map<std::string, std::s
 	long long real_downloaded_change = 0;
 	long long max_allowed_bytes_transferred = 999999999999999;
 	
-	if(inserted || params["event"] == "started" || uploaded < p->uploaded || downloaded < p->downloaded) {
+	if(inserted || params.event == "started" || uploaded < p->uploaded || downloaded < p->downloaded) {
 		//New peer on this torrent
 		update_torrent = true;
 		p->userid = u.id;
-		p->peer_id = peer_id;
-		p->user_agent = headers["user-agent"];
+		// Interning takes the string table's lock, so it's only done when
+		// a peer starts. Clients don't change their agent mid-session.
+		p->user_agent = db->intern_user_agent(params.user_agent, u.id);
 		p->first_announced = cur_time;
 		p->last_announced = 0;
 		if(uploaded > max_allowed_bytes_transferred) {
@@ -327,7 +412,7 @@ std::string worker::announce(torrent &tor, user &u, std::map<std::string, std::s
 			p->downloaded = downloaded;
 		}
 		if(uploaded_change || downloaded_change) {
-			long corrupt = strtolong(params["corrupt"]);
+			long corrupt = strtolong(params.corrupt);
 			tor.balance += uploaded_change;
 			tor.balance -= downloaded_change;
 			tor.balance -= corrupt;
@@ -337,26 +422,29 @@ std::string worker::announce(torrent &tor, user &u, std::map<std::string, std::s
 				upspeed = uploaded_change / (cur_time - p->last_announced);
 				downspeed = downloaded_change / (cur_time - p->last_announced);
 			}
-			std::map<int, slots_t>::iterator sit = tor.tokened_users.find(u.id);
+			slots_t *slots = NULL;
+			if(tor.tokened_users) {
+				token_map::iterator sit = tor.tokened_users->find(u.id);
+				if(sit != tor.tokened_users->end()) {
+					slots = &sit->second;
+				}
+			}
 
                         // Lanz: If we are using a token update the record for it with the accurate stats first.
-                        if(sit != tor.tokened_users.end()) {
-                                std::stringstream record;
-                                record << '(' << u.id << ',' << tor.id << ',' << downloaded_change << ',' << uploaded_change << ')';
-                                std::string record_str = record.str();
-                                db->record_token(record_str);
+                        if(slots) {
+                                db->record_token(u.id, tor.id, downloaded_change, uploaded_change);
                         }
 					
                         if (tor.free_torrent == NEUTRAL) {
 				downloaded_change = 0;
 				uploaded_change = 0;
-			} else if(tor.free_torrent == FREE || (site_options.freeleech >= now) || 
-                                 (sit != tor.tokened_users.end() && sit->second.free_leech >= now) || u.pfl >= now || u.pmid == 20) {
+			} else if(tor.free_torrent == FREE || (site_freeleech >= now) || 
+                                 (slots && slots->free_leech >= now) || u.pfl >= now || u.pmid == 20) {
 				downloaded_change = 0;
 			}
 			
                         // Lanz, double seed gives you double upload ammount.
-                        if (tor.double_seed || (sit != tor.tokened_users.end() && sit->second.double_seed >= now)) {
+                        if (tor.double_seed || (slots && slots->double_seed >= now)) {
 								if(uploaded_change > max_allowed_bytes_transferred) {
 									uploaded_change=max_allowed_bytes_transferred;
 								}
@@ -365,503 +453,751 @@ std::string worker::announce(torrent &tor, user &u, std::map<std::string, std::s
 
 			if(uploaded_change || downloaded_change || real_uploaded_change || real_downloaded_change) {
 				//Changed the condition to accurately catch real changes
-				std::stringstream record;
-
-				record << '(' << u.id << ',' << uploaded_change << ',' << downloaded_change << ',' << real_uploaded_change << ',' << real_downloaded_change << ')';
-				std::string record_str = record.str();
-				db->record_user(record_str);
+				db->record_user(u.id, uploaded_change, downloaded_change, real_uploaded_change, real_downloaded_change);
 			}
 		}
 	}
 	p->last_announced = cur_time;
+	if(inserted) {
+		peer_expiry entry;
+		entry.info_hash = info_hash;
+		entry.peer_id = peer_id;
+		p->expiry_tick = shard.expiry.add(expiry_tick(cur_time), entry);
+	}
 	
-	std::map<std::string, std::string>::const_iterator param_ip = params.find("ip");
-	if(param_ip != params.end()) {
-		ip = param_ip->second;
-	} else {
-		param_ip = params.find("ipv4");
-		if(param_ip != params.end()) {
-			ip = param_ip->second;
+	// Clients may announce a different address than the one they connect from
+	boost::string_ref param_ip = params.ip.empty() ? params.ipv4 : params.ip;
+	if(!param_ip.empty()) {
+		char ip_str[INET_ADDRSTRLEN];
+		if(param_ip.size() >= sizeof(ip_str)) {
+			return error("Specified IP address is of a bad length", output);
 		}
+		memcpy(ip_str, param_ip.data(), param_ip.size());
+		ip_str[param_ip.size()] = '\0';
+		in_addr addr;
+		if(inet_pton(AF_INET, ip_str, &addr) != 1) {
+			return error("Unexpected character in IP address. Only IPv4 is currently supported", output);
+		}
+		ip = addr.s_addr;
 	}
 	
-	unsigned int port = strtolong(params["port"]);
+	unsigned int port = strtolong(params.port);
 	// Generate compact ip/port string
 	if(inserted || port != p->port || ip != p->ip) {
 		p->port = port;
 		p->ip = ip;
-		p->ip_port = "";
-		char x = 0;
-		for(size_t pos = 0, end = ip.length(); pos < end; pos++) {
-			if(ip[pos] == '.') {
-				p->ip_port.push_back(x);
-				x = 0;
-				continue;
-			} else if(!isdigit(ip[pos])) {
-				return error("Unexpected character in IP address. Only IPv4 is currently supported");
-			}
-			x = x * 10 + ip[pos] - '0';
-		}
-		p->ip_port.push_back(x);
-		p->ip_port.push_back(port >> 8);
-		p->ip_port.push_back(port & 0xFF);
-		if(p->ip_port.length() != 6) {
-			return error("Specified IP address is of a bad length");
-		}
+		char ip_port[6];
+		memcpy(ip_port, &ip, 4); // Already in network byte order
+		ip_port[4] = port >> 8;
+		ip_port[5] = port & 0xFF;
+		plist->set_endpoint(i, ip_port);
 	}
 	
 	// Select peers!
 	unsigned int numwant;
-	std::map<std::string, std::string>::const_iterator param_numwant = params.find("numwant");
-	if(param_numwant == params.end()) {
+	if(params.numwant.empty()) {
 		numwant = 50;
 	} else {
-		numwant = std::min(50l, strtolong(param_numwant->second));
+		numwant = std::min(50l, strtolong(params.numwant));
 	}
 
-	int snatches = 0;
 	int active = 1;
-	if(params["event"] == "stopped") {
+	time_t first_announced = p->first_announced;
+	unsigned int announces = p->announces;
+	string_id user_agent = p->user_agent;
+	if(params.event == "stopped") {
 		update_torrent = true;
 		active = 0;
 		numwant = 0;
 
-		if(left > 0) {
-			if(tor.leechers.erase(peer_id) == 0) {
-				std::cout << "Tried and failed to remove seeder from torrent " << tor.id << std::endl;
-			}
-		} else {
-			if(tor.seeders.erase(peer_id) == 0) {
-				std::cout << "Tried and failed to remove leecher from torrent " << tor.id << std::endl;
-			}
-		}
-	} else if(params["event"] == "completed") {
-		snatches = 1;
+		// p is gone after this
+		plist->erase_at(i);
+		p = NULL;
+	} else if(params.event == "completed") {
 		update_torrent = true;
 		tor.completed++;
-		
-		std::stringstream record;
-		record << '(' << u.id << ',' << tor.id << ',' << cur_time << ", '" << ip << "')";
-		std::string record_str = record.str();
-		db->record_snatch(record_str);
+		tor.pending_snatches++;
+		db->record_snatch(u.id, tor.id, cur_time, ip);
 		
 		// User is a seeder now!
-		tor.seeders.insert(std::pair<std::string, peer>(peer_id, *p));
-		tor.leechers.erase(peer_id);
-	}
-
-	std::string peers;
-	if(numwant > 0) {
-		peers.reserve(300);
-		unsigned int found_peers = 0;
-		if(left > 0) { // Show seeders to leechers first
-			if(tor.seeders.size() > 0) {
-				// We do this complicated stuff to cycle through the seeder list, so all seeders will get shown to leechers
-				
-				// Find out where to begin in the seeder list
-				peer_list::const_iterator i;
-				if(tor.last_selected_seeder == "") {
-					i = tor.seeders.begin();
-				} else {
-					i = tor.seeders.find(tor.last_selected_seeder);
-					i++;
-					if(i == tor.seeders.end()) {
-						i = tor.seeders.begin();
-					}
-				}
-				
-				// Find out where to end in the seeder list
-				peer_list::const_iterator end;
-				if(i == tor.seeders.begin()) {
-					end = tor.seeders.end();
-				} else {
-					end = i;
-					end--;
-				}
-				
-				// Add seeders
-				while(i != end && found_peers < numwant) {
-					if(i == tor.seeders.end()) {
-						i = tor.seeders.begin();
-					}
-					peers.append(i->second.ip_port);
-					found_peers++;
-					tor.last_selected_seeder = i->second.peer_id;
-					i++;
-				}
-			}
-
-			if(found_peers < numwant && tor.leechers.size() > 1) {
-				for(peer_list::const_iterator i = tor.leechers.begin(); i != tor.leechers.end() && found_peers < numwant; i++) {
-					if(i->second.ip_port == p->ip_port) { // Don't show leechers themselves
-						continue; 
-					}
-					found_peers++;
-					peers.append(i->second.ip_port);
-				}
-				
-			}
-		} else if(tor.leechers.size() > 0) { // User is a seeder, and we have leechers!
-			for(peer_list::const_iterator i = tor.leechers.begin(); i != tor.leechers.end() && found_peers < numwant; i++) {
-				found_peers++;
-				peers.append(i->second.ip_port);
+		if(plist == &swarm.leechers) {
+			size_t seeder = swarm.seeders.find(peer_id);
+			if(seeder == peer_list::npos) {
+				seeder = swarm.seeders.insert(peer_id, *p);
+			} else {
+				swarm.seeders[seeder] = *p;
 			}
+			swarm.seeders.set_endpoint(seeder, swarm.leechers.endpoint(i));
+			swarm.leechers.erase_at(i);
+			plist = &swarm.seeders;
+			i = seeder;
+			p = &swarm.seeders[i];
 		}
 	}
-	
-	if(update_torrent || tor.last_flushed + 3600 < cur_time) {
-		tor.last_flushed = cur_time;
-		
-		std::stringstream record;
-		record << '(' << tor.id << ',' << tor.seeders.size() << ',' << tor.leechers.size() << ',' << snatches << ',' << tor.balance << ')';
-		std::string record_str = record.str();
-		db->record_torrent(record_str);
+
+	if(update_torrent || swarm.last_flushed + 3600 < cur_time) {
+		mark_dirty(shard, info_hash, tor);
 	}
 	
-	std::stringstream record;
-	record << '(' << u.id << ',' << tor.id << ',' << active << ',' << uploaded << ',' << downloaded << ',' << upspeed << ',' << downspeed << ',' << left << ',' << (cur_time - p->first_announced) << ',' << p->announces << ',';
-	std::string record_str = record.str();
-	db->record_peer(record_str, ip, port, peer_id, headers["user-agent"]);
+	peer_row_key row_key;
+	row_key.userid = u.id;
+	row_key.torrentid = tor.id;
+	row_key.peer_id = peer_id;
+	peer_row row;
+	row.active = active;
+	row.uploaded = uploaded;
+	row.downloaded = downloaded;
+	row.upspeed = upspeed;
+	row.downspeed = downspeed;
+	row.left = left;
+	row.timespent = cur_time - first_announced;
+	row.announces = announces;
+	row.ip = ip;
+	row.port = port;
+	row.user_agent = user_agent;
+	row.mtime = cur_time;
+	db->record_peer(row_key, row);
+	
 // Lanz, disapled since it's not used in the front end and table is missing. Add later?
 // Re-enabled.
         if (upspeed >= conf->keep_speed) { //real_uploaded_change > 0 || real_downloaded_change > 0
-		record.str("");
-		record << '(' << u.id << ',' << real_downloaded_change << ',' << left << ',' << real_uploaded_change << ',' << upspeed << ',' << downspeed << ',' << (cur_time - p->first_announced);
-		record_str = record.str();
-		db->record_peer_hist(record_str, peer_id, ip, tor.id);
+		peer_hist_record record;
+		record.userid = u.id;
+		record.torrentid = tor.id;
+		record.downloaded = real_downloaded_change;
+		record.left = left;
+		record.uploaded = real_uploaded_change;
+		record.upspeed = upspeed;
+		record.downspeed = downspeed;
+		record.timespent = cur_time - first_announced;
+		record.peer_id = peer_id;
+		record.ip = ip;
+		record.mtime = cur_time;
+		db->record_peer_hist(record);
 	} 
 	// Bit torrent spec mandates that the keys are sorted. 
 
-	std::string response = "d";
-	response.reserve(350);
-	response += "8:completei";
-	response += inttostr(tor.seeders.size());
-	response += "e10:downloadedi";
-	response += inttostr(tor.completed);
-	response += "e10:incompletei";
-	response += inttostr(tor.leechers.size());
-	response +="e8:intervali";
-	response += inttostr(conf->announce_interval+std::min((size_t)600, tor.seeders.size())); // ensure a more even distribution of announces/second
-	response += "e12:min intervali";
-	response += inttostr(conf->announce_interval);
-	response += "e5:peers";
-	if(peers.length() == 0) {
-		response += "0:";
-	} else {
-		response += inttostr(peers.length());
-		response += ":";
-		response += peers;
+	output += "d8:completei";
+	append_int(output, swarm.seeders.size());
+	output += "e10:downloadedi";
+	append_int(output, tor.completed);
+	output += "e10:incompletei";
+	append_int(output, swarm.leechers.size());
+	output += "e8:intervali";
+	append_int(output, conf->announce_interval + std::min((size_t)600, swarm.seeders.size())); // ensure a more even distribution of announces/second
+	output += "e12:min intervali";
+	append_int(output, conf->announce_interval);
+	output += "e5:peers";
+	
+	// Peers go straight into output, with their length put in front after
+	size_t peers_start = output.size();
+	if(numwant > 0) {
+		unsigned int found_peers = 0;
+		if(left > 0) { // Show seeders to leechers first
+			if(swarm.seeders.size() > 0) {
+				// Cycle through the seeder list, so all seeders will get shown to leechers
+				size_t start = swarm.next_seeder < swarm.seeders.size() ? swarm.next_seeder : 0;
+				size_t count = std::min<size_t>(numwant, swarm.seeders.size());
+				swarm.seeders.append_endpoints(output, start, count);
+				found_peers += count;
+				swarm.next_seeder = (start + count) % swarm.seeders.size();
+			}
+
+			if(found_peers < numwant && swarm.leechers.size() > 1) {
+				// Don't show leechers themselves
+				found_peers += select_leechers(swarm, output, numwant - found_peers, plist == &swarm.leechers ? i : peer_list::npos);
+			}
+		} else if(swarm.leechers.size() > 0) { // User is a seeder, and we have leechers!
+			found_peers += select_leechers(swarm, output, numwant, peer_list::npos);
+		}
 	}
-	response += "e";
-	// Outputting the response to console.
-	// std::cerr << "Response string: " << response;
-	return response;
+	char peers_length[24];
+	int length = snprintf(peers_length, sizeof(peers_length), "%zu:", output.size() - peers_start);
+	output.insert(peers_start, peers_length, length);
+	output += 'e';
 }
 
-std::string worker::scrape(const std::list<std::string> &infohashes) {
+void worker::scrape(const std::list<std::string> &infohashes, std::string &output) {
 	// much less needed to be fixed here for compliance. Mobbo
-	std::string output = "d5:filesd";
+	output += "d5:filesd";
 	for(std::list<std::string>::const_iterator i = infohashes.begin(); i != infohashes.end(); i++) {
-		std::string infohash = *i;
-		infohash = hex_decode(infohash);
+		infohash_t infohash;
+		if(!hex_decode(*i, infohash.data(), infohash.size())) {
+			continue;
+		}
 		
-		torrent_list::iterator tor = torrents_list.find(infohash);
-		if(tor == torrents_list.end()) {
+		torrent_shard &shard = torrents_list.shard_for(infohash);
+		boost::mutex::scoped_lock shard_lock(shard.lock);
+		torrent_list::iterator tor = shard.torrents.find(infohash);
+		if(tor == shard.torrents.end()) {
 			continue;
 		}
 		torrent *t = &(tor->second);
 		
-		output += inttostr(infohash.length());
-		output += ':';
-		output += infohash;
+		output += "20:";
+		output.append(reinterpret_cast<const char *>(infohash.data()), infohash.size());
 		output += "d8:completei";
-		output += inttostr(t->seeders.size());
+		append_int(output, seeder_count(*t));
 		output += "e10:downloadedi";
-		output += inttostr(t->completed);
+		append_int(output, t->completed);
 		output += "e10:incompletei";
-		output += inttostr(t->leechers.size());
+		append_int(output, leecher_count(*t));
 		output += "ee";
 	}
 	output+="ee";
 	// Outputting the response to console.
 	// std::cerr << "Response string: " << output;
-	return output;
+}
+
+// Update actions are dispatched through a perfect hash of their name. The
+// hash of every action is worked out at compile time for the case labels in
+// worker::update, so two actions colliding is a compile error.
+static constexpr unsigned int update_hash(const char *name, size_t length) {
+	return length == 0 ? 0 : (name[0] + name[length - 1] * 29 + length * 7) & (UPDATE_HASH_SIZE - 1);
+}
+
+template<size_t N> static constexpr unsigned int update_hash(const char (&name)[N]) {
+	return update_hash(name, N - 1);
 }
 
 //TODO: Restrict to local IPs
-std::string worker::update(std::map<std::string, std::string> &params) {
-        if(params["action"] == "site_option") {
-            if(params["set"] == "freeleech") {
-                site_options.freeleech = (time_t)atoi(params["time"].c_str());
-            }
-        } else if(params["action"] == "change_passkey") {
-		std::string oldpasskey = params["oldpasskey"];
-		std::string newpasskey = params["newpasskey"];
-		user_list::iterator i = users_list.find(oldpasskey);
-		if (i == users_list.end()) {
-			std::cout << "No user with passkey " << oldpasskey << " exists when attempting to change passkey to " << newpasskey << std::endl;
-		} else {
-			users_list[newpasskey] = i->second;;
-			users_list.erase(oldpasskey);
-			std::cout << "changed passkey from " << oldpasskey << " to " << newpasskey << " for user " << i->second.id << std::endl;
-		}
-	} else if(params["action"] == "add_torrent") {
-		torrent t;
-		t.id = strtolong(params["id"]);
-		std::string info_hash = params["info_hash"];
-		info_hash = hex_decode(info_hash);
-		if(params["freetorrent"] == "0") {
-			t.free_torrent = NORMAL;
-		} else if(params["freetorrent"] == "1") {
-			t.free_torrent = FREE;
-		} else {
-			t.free_torrent = NEUTRAL;
-		}
-		t.balance = 0;
-		t.completed = 0;
-		t.last_selected_seeder = "";
-		torrents_list[info_hash] = t;
-		std::cout << "Added torrent " << t.id<< ". FL: " << t.free_torrent << " " << params["freetorrent"] << std::endl;
-	} else if(params["action"] == "update_torrent") {
-		std::string info_hash = params["info_hash"];
-		info_hash = hex_decode(info_hash);
-		freetype fl;
-		if(params["freetorrent"] == "0") {
-			fl = NORMAL;
-		} else if(params["freetorrent"] == "1") {
-			fl = FREE;
-		} else {
-			fl = NEUTRAL;
+void worker::update(std::map<std::string, std::string> &params, std::string &output) {
+	const std::string &action = params["action"];
+	const char *name = NULL;
+	update_handler handler = NULL;
+	unsigned int hash = update_hash(action.data(), action.size());
+	switch(hash) {
+		case update_hash("site_option"): name = "site_option"; handler = &worker::update_site_option; break;
+		case update_hash("change_passkey"): name = "change_passkey"; handler = &worker::update_change_passkey; break;
+		case update_hash("add_torrent"): name = "add_torrent"; handler = &worker::update_add_torrent; break;
+		case update_hash("update_torrent"): name = "update_torrent"; handler = &worker::update_update_torrent; break;
+		case update_hash("update_torrents"): name = "update_torrents"; handler = &worker::update_update_torrents; break;
+		case update_hash("add_token_fl"): name = "add_token_fl"; handler = &worker::update_add_token_fl; break;
+		case update_hash("add_token_ds"): name = "add_token_ds"; handler = &worker::update_add_token_ds; break;
+		case update_hash("remove_tokens"): name = "remove_tokens"; handler = &worker::update_remove_tokens; break;
+		case update_hash("delete_torrent"): name = "delete_torrent"; handler = &worker::update_delete_torrent; break;
+		case update_hash("add_user"): name = "add_user"; handler = &worker::update_add_user; break;
+		case update_hash("remove_user"): name = "remove_user"; handler = &worker::update_remove_user; break;
+		case update_hash("remove_users"): name = "remove_users"; handler = &worker::update_remove_users; break;
+		case update_hash("update_user"): name = "update_user"; handler = &worker::update_update_user; break;
+		case update_hash("set_personal_freeleech"): name = "set_personal_freeleech"; handler = &worker::update_set_personal_freeleech; break;
+		case update_hash("set_permissionid"): name = "set_permissionid"; handler = &worker::update_set_permissionid; break;
+		case update_hash("add_blacklist"): name = "add_blacklist"; handler = &worker::update_add_blacklist; break;
+		case update_hash("remove_blacklist"): name = "remove_blacklist"; handler = &worker::update_remove_blacklist; break;
+		case update_hash("edit_blacklist"): name = "edit_blacklist"; handler = &worker::update_edit_blacklist; break;
+		case update_hash("update_announce_interval"): name = "update_announce_interval"; handler = &worker::update_update_announce_interval; break;
+		case update_hash("info_torrent"): name = "info_torrent"; handler = &worker::update_info_torrent; break;
+	}
+	if(handler == NULL || action != name) {
+		std::cout << "Unknown update action " << action << std::endl;
+		output += "success";
+		return;
+	}
+	
+	boost::mutex::scoped_lock lock(update_lock);
+	timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	(this->*handler)(params);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	
+	update_action_stats &stats = update_stats[hash];
+	stats.name = name;
+	stats.count++;
+	stats.usec += (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+	output += "success";
+}
+
+// Prints how many of each update action ran since the last call, and how long they took
+void worker::print_update_stats() {
+	boost::mutex::scoped_lock lock(update_lock);
+	for(unsigned int i = 0; i < UPDATE_HASH_SIZE; i++) {
+		update_action_stats &stats = update_stats[i];
+		if(stats.count > 0) {
+			std::cout << "Update " << stats.name << ": " << stats.count << " calls, "
+				<< (stats.usec / stats.count) << " usec avg, " << stats.usec << " usec total" << std::endl;
+			stats.count = 0;
+			stats.usec = 0;
 		}
-		auto torrent_it = torrents_list.find(info_hash);
-		if (torrent_it != torrents_list.end()) {
+	}
+}
+
+// Heap used by the torrent list, including peer lists and token maps
+void worker::print_memory_usage() {
+	size_t count = 0;
+	size_t table_bytes = 0;
+	size_t peer_bytes = 0;
+	size_t token_bytes = 0;
+	size_t peers = 0;
+	for(size_t s = 0; s < TORRENT_SHARDS; s++) {
+		torrent_shard &shard = torrents_list.shard(s);
+		boost::mutex::scoped_lock lock(shard.lock);
+		count += shard.torrents.size();
+		table_bytes += shard.torrents.memory_usage();
+		peer_bytes += shard.expiry.size() * sizeof(peer_expiry);
+		for(torrent_list::const_iterator i = shard.torrents.begin(); i != shard.torrents.end(); i++) {
+			const torrent &tor = i->second;
+			if(tor.swarm) {
+				peer_bytes += sizeof(torrent_swarm) + tor.swarm->seeders.memory_usage() + tor.swarm->leechers.memory_usage();
+				peers += tor.swarm->seeders.size() + tor.swarm->leechers.size();
+			}
+			if(tor.tokened_users) {
+				// Roughly what a red-black tree node costs on top of its value
+				token_bytes += sizeof(token_map) + tor.tokened_users->size() * (sizeof(token_map::value_type) + 32);
+			}
+		}
+	}
+	size_t total = table_bytes + peer_bytes + token_bytes;
+	std::cout << "Torrent memory: " << count << " torrents, " << peers << " peers, " << (total >> 10) << " KiB total ("
+		<< (table_bytes >> 10) << " KiB table, " << (peer_bytes >> 10) << " KiB peers, " << (token_bytes >> 10) << " KiB tokens), "
+		<< (count ? (table_bytes + token_bytes) / count : 0) << " bytes per torrent excluding peers, sizeof(torrent) " << sizeof(torrent) << std::endl;
+}
+
+void worker::update_site_option(std::map<std::string, std::string> &params) {
+	boost::unique_lock<boost::shared_mutex> users_write_lock(users_lock);
+	if(params["set"] == "freeleech") {
+		site_options.freeleech = (time_t)atoi(params["time"].c_str());
+	}
+}
+
+void worker::update_change_passkey(std::map<std::string, std::string> &params) {
+	boost::unique_lock<boost::shared_mutex> users_write_lock(users_lock);
+	std::string oldpasskey = params["oldpasskey"];
+	std::string newpasskey = params["newpasskey"];
+	passkey_t old_key, new_key;
+	user_list::iterator i = users_list.end();
+	if (hex_to_bin(oldpasskey, old_key.data(), old_key.size())) {
+		i = users_list.find(old_key);
+	}
+	if (i == users_list.end()) {
+		std::cout << "No user with passkey " << oldpasskey << " exists when attempting to change passkey to " << newpasskey << std::endl;
+	} else if (!hex_to_bin(newpasskey, new_key.data(), new_key.size())) {
+		std::cout << "Malformed passkey " << newpasskey << " when changing passkey for user " << i->second.id << std::endl;
+	} else {
+		user u = i->second;
+		users_list.erase(i);
+		users_list[new_key] = u;
+		std::cout << "changed passkey from " << oldpasskey << " to " << newpasskey << " for user " << u.id << std::endl;
+	}
+}
+
+void worker::update_add_torrent(std::map<std::string, std::string> &params) {
+	torrent t;
+	t.id = strtolong(params["id"]);
+	infohash_t info_hash;
+	if(!hex_decode(params["info_hash"], info_hash.data(), info_hash.size())) {
+		std::cout << "Malformed info_hash when adding torrent " << t.id << std::endl;
+		return;
+	}
+	if(params["freetorrent"] == "0") {
+		t.free_torrent = NORMAL;
+	} else if(params["freetorrent"] == "1") {
+		t.free_torrent = FREE;
+	} else {
+		t.free_torrent = NEUTRAL;
+	}
+	t.balance = 0;
+	t.completed = 0;
+	t.dirty = false;
+	t.pending_snatches = 0;
+	std::cout << "Added torrent " << t.id << ". FL: " << t.free_torrent << " " << params["freetorrent"] << std::endl;
+	torrent_shard &shard = torrents_list.shard_for(info_hash);
+	boost::mutex::scoped_lock lock(shard.lock);
+	shard.torrents[info_hash] = std::move(t);
+}
+
+void worker::update_update_torrent(std::map<std::string, std::string> &params) {
+	infohash_t info_hash = infohash_t();
+	bool valid = hex_decode(params["info_hash"], info_hash.data(), info_hash.size());
+	freetype fl;
+	if(params["freetorrent"] == "0") {
+		fl = NORMAL;
+	} else if(params["freetorrent"] == "1") {
+		fl = FREE;
+	} else {
+		fl = NEUTRAL;
+	}
+	torrent_shard &shard = torrents_list.shard_for(info_hash);
+	boost::mutex::scoped_lock lock(shard.lock);
+	auto torrent_it = valid ? shard.torrents.find(info_hash) : shard.torrents.end();
+	if (torrent_it != shard.torrents.end()) {
+		torrent_it->second.free_torrent = fl;
+		std::cout << "Updated torrent " << torrent_it->second.id << " to FL " << fl << std::endl;
+	} else {
+		std::cout << "Failed to find torrent " << params["info_hash"] << " to FL " << fl << std::endl;
+	}
+}
+
+void worker::update_update_torrents(std::map<std::string, std::string> &params) {
+	// Each decoded infohash is exactly 20 characters long.
+	std::string info_hashes = params["info_hashes"];
+	info_hashes = hex_decode(info_hashes);
+	freetype fl;
+	if(params["freetorrent"] == "0") {
+		fl = NORMAL;
+	} else if(params["freetorrent"] == "1") {
+		fl = FREE;
+	} else {
+		fl = NEUTRAL;
+	}
+	for(unsigned int pos = 0; pos < info_hashes.length(); pos += 20) {
+		if(pos + 20 > info_hashes.length()) {
+			break;
+		}
+		infohash_t info_hash;
+		memcpy(info_hash.data(), info_hashes.data() + pos, 20);
+		torrent_shard &shard = torrents_list.shard_for(info_hash);
+		boost::mutex::scoped_lock lock(shard.lock);
+		auto torrent_it = shard.torrents.find(info_hash);
+		if (torrent_it != shard.torrents.end()) {
 			torrent_it->second.free_torrent = fl;
 			std::cout << "Updated torrent " << torrent_it->second.id << " to FL " << fl << std::endl;
 		} else {
-			std::cout << "Failed to find torrent " << info_hash << " to FL " << fl << std::endl;
-		}
-	} else if(params["action"] == "update_torrents") {
-		// Each decoded infohash is exactly 20 characters long.
-		std::string info_hashes = params["info_hashes"];
-		info_hashes = hex_decode(info_hashes);
-		freetype fl;
-		if(params["freetorrent"] == "0") {
-			fl = NORMAL;
-		} else if(params["freetorrent"] == "1") {
-			fl = FREE;
-		} else {
-			fl = NEUTRAL;
-		}
-		for(unsigned int pos = 0; pos < info_hashes.length(); pos += 20) {
-			std::string info_hash = info_hashes.substr(pos, 20);
-			auto torrent_it = torrents_list.find(info_hash);
-			if (torrent_it != torrents_list.end()) {
-				torrent_it->second.free_torrent = fl;
-				std::cout << "Updated torrent " << torrent_it->second.id << " to FL " << fl << std::endl;
-			} else {
-				std::cout << "Failed to find torrent " << info_hash << " to FL " << fl << std::endl;
-			}
+			std::cout << "Failed to find torrent " << bin_to_hex(info_hash.data(), info_hash.size()) << " to FL " << fl << std::endl;
 		}
-        // Lanz, changed add_token to add_token_fl and add_token_ds to deal with the two types.
-	} else if(params["action"] == "add_token_fl") {
-		std::string info_hash = hex_decode(params["info_hash"]);
-		int user_id = atoi(params["userid"].c_str());
-		auto torrent_it = torrents_list.find(info_hash);
-                time_t time = (time_t)atoi(params["time"].c_str());
-
-                // Find the torrent.
-                if (torrent_it != torrents_list.end()) {
-                        std::map<int, slots_t>::iterator sit = torrent_it->second.tokened_users.find(user_id);
-                        // The user already have a slot, update
-                        if (sit != torrent_it->second.tokened_users.end()) {
-                            sit->second.free_leech = time;
-                        } else {
-                            slots_t slots;
-                            slots.free_leech = time;
-                            slots.double_seed = 0;
-                            torrent_it->second.tokened_users.insert(std::pair<int, slots_t>(user_id, slots));
-                        }
-		} else {
-			std::cout << "Failed to find torrent to add a freeleech token for user " << user_id << std::endl;
-		}
-	} else if(params["action"] == "add_token_ds") {
-		std::string info_hash = hex_decode(params["info_hash"]);
-		int user_id = atoi(params["userid"].c_str());
-		auto torrent_it = torrents_list.find(info_hash);
-                time_t time = (time_t)atoi(params["time"].c_str());
-
-                // Find the torrent.
-                if (torrent_it != torrents_list.end()) {
-                        std::map<int, slots_t>::iterator sit = torrent_it->second.tokened_users.find(user_id);
-                        // The user already have a slot, update
-                        if (sit != torrent_it->second.tokened_users.end()) {
-                            sit->second.double_seed = time;
-                        } else {
-                            slots_t slots;
-                            slots.free_leech = 0;
-                            slots.double_seed = time;
-                            torrent_it->second.tokened_users.insert(std::pair<int, slots_t>(user_id, slots));
-                        }		
-                } else {
-			std::cout << "Failed to find torrent to add a double seed token for user " << user_id << std::endl;
-		}
-        // Lanz: Changed to plural tokens for now since this will remove both double seed and freeleech. 
-        // better granularity might be needed later though.
-	} else if(params["action"] == "remove_tokens") {
-		std::string info_hash = hex_decode(params["info_hash"]);
-		int user_id = atoi(params["userid"].c_str());
-		auto torrent_it = torrents_list.find(info_hash);
-		if (torrent_it != torrents_list.end()) {
-			torrent_it->second.tokened_users.erase(user_id);
-		} else {
-			std::cout << "Failed to find torrent " << info_hash << " to remove tokens for user " << user_id << std::endl;
-		}
-	} else if(params["action"] == "delete_torrent") {
-		std::string info_hash = params["info_hash"];
-		info_hash = hex_decode(info_hash);
-		auto torrent_it = torrents_list.find(info_hash);
-		if (torrent_it != torrents_list.end()) {
-			std::cout << "Deleting torrent " << torrent_it->second.id << std::endl;
-			torrents_list.erase(torrent_it);
-		} else {
-			std::cout << "Failed to find torrent " << info_hash << " to delete " << std::endl;
-		}
-	} else if(params["action"] == "add_user") {
-		std::string passkey = params["passkey"];
-		unsigned int id = strtolong(params["id"]);
-		user u;
-		u.id = id;
-		u.can_leech = 1;
-		users_list[passkey] = u;
-		std::cout << "Added user " << id << std::endl;
-	} else if(params["action"] == "remove_user") {
-		std::string passkey = params["passkey"];
-		users_list.erase(passkey);
-		std::cout << "Removed user " << passkey << std::endl;
-	} else if(params["action"] == "remove_users") {
-		// Each passkey is exactly 32 characters long.
-		std::string passkeys = params["passkeys"];
-		for(unsigned int pos = 0; pos < passkeys.length(); pos += 32){
-			std::string passkey = passkeys.substr(pos, 32);
-			users_list.erase(passkey);
-			std::cout << "Removed user " << passkey << std::endl;
-		}
-	} else if(params["action"] == "update_user") {
-		std::string passkey = params["passkey"];
-		bool can_leech = true;
-		if(params["can_leech"] == "0") {
-			can_leech = false;
-		}
-
-		user_list::iterator i = users_list.find(passkey);
-		if (i == users_list.end()) {
-			std::cout << "No user with passkey " << passkey << " found when attempting to change leeching status!" << std::endl;
+	}
+}
+
+// Lanz, changed add_token to add_token_fl and add_token_ds to deal with the two types.
+void worker::update_add_token_fl(std::map<std::string, std::string> &params) {
+	infohash_t info_hash = infohash_t();
+	int user_id = atoi(params["userid"].c_str());
+	bool valid = hex_decode(params["info_hash"], info_hash.data(), info_hash.size());
+	torrent_shard &shard = torrents_list.shard_for(info_hash);
+	boost::mutex::scoped_lock lock(shard.lock);
+	auto torrent_it = valid ? shard.torrents.find(info_hash) : shard.torrents.end();
+	time_t time = (time_t)atoi(params["time"].c_str());
+
+	// Find the torrent.
+	if (torrent_it != shard.torrents.end()) {
+		std::unique_ptr<token_map> &tokens = torrent_it->second.tokened_users;
+		if (!tokens) {
+			tokens.reset(new token_map);
+		}
+		token_map::iterator sit = tokens->find(user_id);
+		// The user already have a slot, update
+		if (sit != tokens->end()) {
+			sit->second.free_leech = time;
 		} else {
-			users_list[passkey].can_leech = can_leech;
-			std::cout << "Updated user " << passkey << std::endl;
-		}
-	} else if(params["action"] == "set_personal_freeleech") {
-		std::string passkey = params["passkey"];
-                time_t pfl = (time_t)atoi(params["time"].c_str());
-                
-		user_list::iterator i = users_list.find(passkey);
-		if (i == users_list.end()) {
-			std::cout << "No user with passkey " << passkey << " found when attempting set personal freeleech!" << std::endl;
+			slots_t slots;
+			slots.free_leech = time;
+			slots.double_seed = 0;
+			tokens->insert(std::pair<int, slots_t>(user_id, slots));
+		}
+	} else {
+		std::cout << "Failed to find torrent to add a freeleech token for user " << user_id << std::endl;
+	}
+}
+
+void worker::update_add_token_ds(std::map<std::string, std::string> &params) {
+	infohash_t info_hash = infohash_t();
+	int user_id = atoi(params["userid"].c_str());
+	bool valid = hex_decode(params["info_hash"], info_hash.data(), info_hash.size());
+	torrent_shard &shard = torrents_list.shard_for(info_hash);
+	boost::mutex::scoped_lock lock(shard.lock);
+	auto torrent_it = valid ? shard.torrents.find(info_hash) : shard.torrents.end();
+	time_t time = (time_t)atoi(params["time"].c_str());
+
+	// Find the torrent.
+	if (torrent_it != shard.torrents.end()) {
+		std::unique_ptr<token_map> &tokens = torrent_it->second.tokened_users;
+		if (!tokens) {
+			tokens.reset(new token_map);
+		}
+		token_map::iterator sit = tokens->find(user_id);
+		// The user already have a slot, update
+		if (sit != tokens->end()) {
+			sit->second.double_seed = time;
 		} else {
-			users_list[passkey].pfl = pfl;
-			std::cout << "Personal freeleech set to user " << passkey << " until time: " << params["time"] << std::endl;
-		}
-        } else if(params["action"] == "set_permissionid") {
-                std::string passkey = params["passkey"];
-                int pmid = atoi(params["permissionid"].c_str());
-                
-                user_list::iterator i = users_list.find(passkey);
-                if (i == users_list.end()) {
-                        std::cout << "No user with passkey " << passkey << " found when attempting to set permissionid!" << std::endl;
-                } else {
-                        users_list[passkey].pmid = pmid;
-                        std::cout << "PermissionID " << params["permissionid"] << " set for user " << passkey << std::endl;
-                }
-        } else if(params["action"] == "add_blacklist") {
-		std::string peer_id = params["peer_id"];
-		blacklist.push_back(peer_id);
-		std::cout << "blacklisted " << peer_id << std::endl;
-	} else if(params["action"] == "remove_blacklist") {
-		std::string peer_id = params["peer_id"];
-		for(unsigned int i = 0; i < blacklist.size(); i++) {
-			if(blacklist[i].compare(peer_id) == 0) {
-				blacklist.erase(blacklist.begin() + i);
-				break;
-			}
+			slots_t slots;
+			slots.free_leech = 0;
+			slots.double_seed = time;
+			tokens->insert(std::pair<int, slots_t>(user_id, slots));
 		}
-		std::cout << "De-blacklisted " << peer_id << std::endl;
-	} else if(params["action"] == "edit_blacklist") {
-		std::string new_peer_id = params["new_peer_id"];
-		std::string old_peer_id = params["old_peer_id"];
-		for(unsigned int i = 0; i < blacklist.size(); i++) {
-			if(blacklist[i].compare(old_peer_id) == 0) {
-				blacklist.erase(blacklist.begin() + i);
-				break;
+	} else {
+		std::cout << "Failed to find torrent to add a double seed token for user " << user_id << std::endl;
+	}
+}
+
+// Lanz: Changed to plural tokens for now since this will remove both double seed and freeleech. 
+// better granularity might be needed later though.
+void worker::update_remove_tokens(std::map<std::string, std::string> &params) {
+	infohash_t info_hash = infohash_t();
+	int user_id = atoi(params["userid"].c_str());
+	bool valid = hex_decode(params["info_hash"], info_hash.data(), info_hash.size());
+	torrent_shard &shard = torrents_list.shard_for(info_hash);
+	boost::mutex::scoped_lock lock(shard.lock);
+	auto torrent_it = valid ? shard.torrents.find(info_hash) : shard.torrents.end();
+	if (torrent_it != shard.torrents.end()) {
+		std::unique_ptr<token_map> &tokens = torrent_it->second.tokened_users;
+		if (tokens) {
+			tokens->erase(user_id);
+			if (tokens->empty()) {
+				tokens.reset();
 			}
 		}
-		blacklist.push_back(new_peer_id);
-		std::cout << "Edited blacklist item from " << old_peer_id << " to " << new_peer_id << std::endl;
-	} else if(params["action"] == "update_announce_interval") {
-		unsigned int interval = strtolong(params["new_announce_interval"]);
-		conf->announce_interval = interval;
-		std::cout << "Edited announce interval to " << interval << std::endl;
-	} else if(params["action"] == "info_torrent") {
-		std::string info_hash_hex = params["info_hash"];
-		std::string info_hash = hex_decode(info_hash_hex);
-		std::cout << "Info for torrent '" << info_hash_hex << "'" << std::endl;
-		auto torrent_it = torrents_list.find(info_hash);
-		if (torrent_it != torrents_list.end()) {
-			std::cout << "Torrent " << torrent_it->second.id
-				<< ", freetorrent = " << torrent_it->second.free_torrent << std::endl;
-		} else {
-			std::cout << "Failed to find torrent " << info_hash_hex << std::endl;
+	} else {
+		std::cout << "Failed to find torrent " << params["info_hash"] << " to remove tokens for user " << user_id << std::endl;
+	}
+}
+
+void worker::update_delete_torrent(std::map<std::string, std::string> &params) {
+	infohash_t info_hash = infohash_t();
+	bool valid = hex_decode(params["info_hash"], info_hash.data(), info_hash.size());
+	torrent_shard &shard = torrents_list.shard_for(info_hash);
+	boost::mutex::scoped_lock lock(shard.lock);
+	auto torrent_it = valid ? shard.torrents.find(info_hash) : shard.torrents.end();
+	if (torrent_it != shard.torrents.end()) {
+		std::cout << "Deleting torrent " << torrent_it->second.id << std::endl;
+		shard.torrents.erase(torrent_it);
+		db->clean_torrents();
+	} else {
+		std::cout << "Failed to find torrent " << params["info_hash"] << " to delete " << std::endl;
+	}
+}
+
+void worker::update_add_user(std::map<std::string, std::string> &params) {
+	boost::unique_lock<boost::shared_mutex> users_write_lock(users_lock);
+	std::string passkey = params["passkey"];
+	unsigned int id = strtolong(params["id"]);
+	passkey_t key;
+	if(!hex_to_bin(passkey, key.data(), key.size())) {
+		std::cout << "Malformed passkey " << passkey << " when adding user " << id << std::endl;
+		return;
+	}
+	user u;
+	u.id = id;
+	u.can_leech = 1;
+	u.pfl = 0;
+	u.pmid = 0;
+	users_list[key] = u;
+	std::cout << "Added user " << id << std::endl;
+}
+
+void worker::update_remove_user(std::map<std::string, std::string> &params) {
+	boost::unique_lock<boost::shared_mutex> users_write_lock(users_lock);
+	std::string passkey = params["passkey"];
+	passkey_t key;
+	if(hex_to_bin(passkey, key.data(), key.size())) {
+		users_list.erase(key);
+	}
+	std::cout << "Removed user " << passkey << std::endl;
+}
+
+void worker::update_remove_users(std::map<std::string, std::string> &params) {
+	boost::unique_lock<boost::shared_mutex> users_write_lock(users_lock);
+	// Each passkey is exactly 32 characters long.
+	std::string passkeys = params["passkeys"];
+	for(unsigned int pos = 0; pos < passkeys.length(); pos += 32){
+		std::string passkey = passkeys.substr(pos, 32);
+		passkey_t key;
+		if(hex_to_bin(passkey, key.data(), key.size())) {
+			users_list.erase(key);
 		}
+		std::cout << "Removed user " << passkey << std::endl;
+	}
+}
+
+void worker::update_update_user(std::map<std::string, std::string> &params) {
+	boost::unique_lock<boost::shared_mutex> users_write_lock(users_lock);
+	std::string passkey = params["passkey"];
+	bool can_leech = true;
+	if(params["can_leech"] == "0") {
+		can_leech = false;
+	}
+
+	passkey_t key;
+	user_list::iterator i = users_list.end();
+	if (hex_to_bin(passkey, key.data(), key.size())) {
+		i = users_list.find(key);
+	}
+	if (i == users_list.end()) {
+		std::cout << "No user with passkey " << passkey << " found when attempting to change leeching status!" << std::endl;
+	} else {
+		i->second.can_leech = can_leech;
+		std::cout << "Updated user " << passkey << std::endl;
+	}
+}
+
+void worker::update_set_personal_freeleech(std::map<std::string, std::string> &params) {
+	boost::unique_lock<boost::shared_mutex> users_write_lock(users_lock);
+	std::string passkey = params["passkey"];
+	time_t pfl = (time_t)atoi(params["time"].c_str());
+
+	passkey_t key;
+	user_list::iterator i = users_list.end();
+	if (hex_to_bin(passkey, key.data(), key.size())) {
+		i = users_list.find(key);
+	}
+	if (i == users_list.end()) {
+		std::cout << "No user with passkey " << passkey << " found when attempting set personal freeleech!" << std::endl;
+	} else {
+		i->second.pfl = pfl;
+		std::cout << "Personal freeleech set to user " << passkey << " until time: " << params["time"] << std::endl;
+	}
+}
+
+void worker::update_set_permissionid(std::map<std::string, std::string> &params) {
+	boost::unique_lock<boost::shared_mutex> users_write_lock(users_lock);
+	std::string passkey = params["passkey"];
+	int pmid = atoi(params["permissionid"].c_str());
+
+	passkey_t key;
+	user_list::iterator i = users_list.end();
+	if (hex_to_bin(passkey, key.data(), key.size())) {
+		i = users_list.find(key);
+	}
+	if (i == users_list.end()) {
+		std::cout << "No user with passkey " << passkey << " found when attempting to set permissionid!" << std::endl;
+	} else {
+		i->second.pmid = pmid;
+		std::cout << "PermissionID " << params["permissionid"] << " set for user " << passkey << std::endl;
 	}
-	return "success";
 }
 
-void worker::reap_peers() {
-	std::cout << "started reaper" << std::endl;
-	boost::thread thread(&worker::do_reap_peers, this);
+void worker::update_add_blacklist(std::map<std::string, std::string> &params) {
+	boost::unique_lock<boost::shared_mutex> users_write_lock(users_lock);
+	std::string peer_id = params["peer_id"];
+	blacklist.push_back(peer_id);
+	std::cout << "blacklisted " << peer_id << std::endl;
+}
+
+void worker::update_remove_blacklist(std::map<std::string, std::string> &params) {
+	boost::unique_lock<boost::shared_mutex> users_write_lock(users_lock);
+	std::string peer_id = params["peer_id"];
+	for(unsigned int i = 0; i < blacklist.size(); i++) {
+		if(blacklist[i].compare(peer_id) == 0) {
+			blacklist.erase(blacklist.begin() + i);
+			break;
+		}
+	}
+	std::cout << "De-blacklisted " << peer_id << std::endl;
 }
 
-void worker::do_reap_peers() {
-	db->logger_ptr->log("Began worker::do_reap_peers()");
+void worker::update_edit_blacklist(std::map<std::string, std::string> &params) {
+	boost::unique_lock<boost::shared_mutex> users_write_lock(users_lock);
+	std::string new_peer_id = params["new_peer_id"];
+	std::string old_peer_id = params["old_peer_id"];
+	for(unsigned int i = 0; i < blacklist.size(); i++) {
+		if(blacklist[i].compare(old_peer_id) == 0) {
+			blacklist.erase(blacklist.begin() + i);
+			break;
+		}
+	}
+	blacklist.push_back(new_peer_id);
+	std::cout << "Edited blacklist item from " << old_peer_id << " to " << new_peer_id << std::endl;
+}
+
+void worker::update_update_announce_interval(std::map<std::string, std::string> &params) {
+	unsigned int interval = strtolong(params["new_announce_interval"]);
+	conf->announce_interval = interval;
+	std::cout << "Edited announce interval to " << interval << std::endl;
+}
+
+void worker::update_info_torrent(std::map<std::string, std::string> &params) {
+	std::string info_hash_hex = params["info_hash"];
+	infohash_t info_hash = infohash_t();
+	std::cout << "Info for torrent '" << info_hash_hex << "'" << std::endl;
+	bool valid = hex_decode(info_hash_hex, info_hash.data(), info_hash.size());
+	torrent_shard &shard = torrents_list.shard_for(info_hash);
+	boost::mutex::scoped_lock lock(shard.lock);
+	auto torrent_it = valid ? shard.torrents.find(info_hash) : shard.torrents.end();
+	if (torrent_it != shard.torrents.end()) {
+		std::cout << "Torrent " << torrent_it->second.id
+			<< ", freetorrent = " << torrent_it->second.free_torrent << std::endl;
+	} else {
+		std::cout << "Failed to find torrent " << info_hash_hex << std::endl;
+	}
+}
+
+// Peers are put in their shard's expiry wheel at the tick they would time
+// out if they never announced again. Announces don't touch the wheel, so when
+// a tick comes up the peers in it are checked: the ones that did announce are
+// put back in at their new timeout tick, the rest are removed. A sweep only
+// looks at peers that were due, instead of every peer of every torrent.
+unsigned int worker::expire_peers() {
 	time_t cur_time = time(NULL);
-	unsigned int reaped = 0;
-	std::unordered_map<std::string, torrent>::iterator i = torrents_list.begin();
-	for(; i != torrents_list.end(); i++) {
-		std::map<std::string, peer>::iterator p = i->second.leechers.begin();
-		std::map<std::string, peer>::iterator del_p;
-		while(p != i->second.leechers.end()) {
-			if(p->second.last_announced + conf->peers_timeout < cur_time) {
-				del_p = p;
-				p++;
-				boost::mutex::scoped_lock lock(db->torrent_list_mutex);
-				i->second.leechers.erase(del_p);
-				reaped++;
-			} else {
-				p++;
+	uint32_t now_tick = cur_time / conf->schedule_interval;
+	unsigned int expired = 0;
+	std::vector<peer_expiry> due;
+	for(size_t s = 0; s < TORRENT_SHARDS; s++) {
+		torrent_shard &shard = torrents_list.shard(s);
+		boost::mutex::scoped_lock lock(shard.lock);
+		uint32_t tick;
+		while(shard.expiry.take_due(now_tick, due, tick)) {
+			for(std::vector<peer_expiry>::const_iterator e = due.begin(); e != due.end(); e++) {
+				torrent_list::iterator tor = shard.torrents.find(e->info_hash);
+				if(tor == shard.torrents.end() || !tor->second.swarm) {
+					continue;
+				}
+				torrent_swarm &swarm = *tor->second.swarm;
+				unsigned int removed = expire_peer(shard, swarm.leechers, *e, tick, cur_time)
+					+ expire_peer(shard, swarm.seeders, *e, tick, cur_time);
+				if(removed > 0) {
+					mark_dirty(shard, e->info_hash, tor->second);
+					expired += removed;
+				}
+				// Every peer has an entry, so the last one to go frees the swarm
+				if(swarm.seeders.size() == 0 && swarm.leechers.size() == 0) {
+					tor->second.swarm.reset();
+				}
 			}
+			due.clear();
 		}
-		p = i->second.seeders.begin();
-		while(p != i->second.seeders.end()) {
-			if(p->second.last_announced + conf->peers_timeout < cur_time) {
-				del_p = p;
-				p++;
-				boost::mutex::scoped_lock lock(db->torrent_list_mutex);
-				i->second.seeders.erase(del_p);
-				reaped++;
-			} else {
-				p++;
+	}
+	return expired;
+}
+
+// Removes the peer if it timed out, or moves its entry to its new timeout tick.
+// Entries for peers that are gone or already have a later entry are dropped.
+unsigned int worker::expire_peer(torrent_shard &shard, peer_list &plist, const peer_expiry &entry, uint32_t tick, time_t cur_time) {
+	size_t pos = plist.find(entry.peer_id);
+	if(pos == peer_list::npos || plist[pos].expiry_tick != tick) {
+		return 0;
+	}
+	peer &p = plist[pos];
+	if(p.last_announced + conf->peers_timeout < cur_time) {
+		plist.erase_at(pos);
+		return 1;
+	}
+	p.expiry_tick = shard.expiry.add(expiry_tick(p.last_announced), entry);
+	return 0;
+}
+
+// Announces and expiry only mark a torrent as needing a write. Its row is
+// made by flush_torrents, so it's written at most once per schedule run.
+void worker::mark_dirty(torrent_shard &shard, const infohash_t &info_hash, torrent &tor) {
+	if(!tor.dirty) {
+		tor.dirty = true;
+		shard.dirty_torrents.push_back(info_hash);
+	}
+}
+
+// Writes every dirty torrent with its peer counts as they are now. Torrents
+// deleted or replaced since they were marked are skipped.
+void worker::flush_torrents() {
+	time_t cur_time = time(NULL);
+	std::vector<infohash_t> dirty;
+	for(size_t s = 0; s < TORRENT_SHARDS; s++) {
+		torrent_shard &shard = torrents_list.shard(s);
+		boost::mutex::scoped_lock lock(shard.lock);
+		dirty.swap(shard.dirty_torrents);
+		for(std::vector<infohash_t>::const_iterator h = dirty.begin(); h != dirty.end(); h++) {
+			torrent_list::iterator it = shard.torrents.find(*h);
+			if(it == shard.torrents.end() || !it->second.dirty) {
+				continue;
+			}
+			torrent &tor = it->second;
+			db->record_torrent(tor.id, seeder_count(tor), leecher_count(tor), tor.pending_snatches, tor.balance);
+			tor.dirty = false;
+			tor.pending_snatches = 0;
+			if(tor.swarm) {
+				tor.swarm->last_flushed = cur_time;
 			}
 		}
+		dirty.clear();
 	}
-	std::cout << "Reaped " << reaped << " peers" << std::endl;
-	db->logger_ptr->log("Completed worker::do_reap_peers()");
+}
+
+uint32_t worker::expiry_tick(time_t last_announced) {
+	return (last_announced + conf->peers_timeout) / conf->schedule_interval;
 }
@@ -6,33 +6,106 @@
 #include <arpa/inet.h>
 #include <iostream>
 #include <fstream>
+#include <atomic>
+#include <boost/utility/string_ref.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
 #include "site_comm.h"
 
 enum tracker_status { OPEN, PAUSED, CLOSING }; // tracker status
 
+// The announce parameters we care about, as views into the request.
+// Values are still url encoded, and empty if the client didn't send them.
+typedef struct {
+	boost::string_ref info_hash;
+	boost::string_ref peer_id;
+	boost::string_ref port;
+	boost::string_ref uploaded;
+	boost::string_ref downloaded;
+	boost::string_ref left;
+	boost::string_ref event;
+	boost::string_ref numwant;
+	boost::string_ref compact;
+	boost::string_ref ip;
+	boost::string_ref ipv4;
+	boost::string_ref corrupt;
+	boost::string_ref user_agent;
+} announce_params;
+
+// Update action names hash into this many slots, see update_hash in worker.cpp
+#define UPDATE_HASH_SIZE 32
+
+typedef struct {
+	const char *name;
+	unsigned long count;
+	unsigned long long usec;
+} update_action_stats;
+
 class worker {
 	private:
                 site_options_t site_options;
-		torrent_list torrents_list;
+		torrent_store torrents_list;
 		user_list users_list;
 		std::vector<std::string> blacklist;
+		
+		// users_lock guards users_list, blacklist and site_options. Announces
+		// take it shared, and may do so while holding a torrent shard lock,
+		// so it must never be held while taking a shard lock.
+		// update_lock lets one update run at a time and guards update_stats.
+		boost::shared_mutex users_lock;
+		boost::mutex update_lock;
 		config * conf;
 		mysql * db;
-		void do_reap_peers();
+		void mark_dirty(torrent_shard &shard, const infohash_t &info_hash, torrent &tor);
+		unsigned int expire_peer(torrent_shard &shard, peer_list &plist, const peer_expiry &entry, uint32_t tick, time_t cur_time);
+		uint32_t expiry_tick(time_t last_announced);
+		unsigned int select_leechers(torrent_swarm &swarm, std::string &peers, unsigned int numwant, size_t self);
 		tracker_status status;
+		std::atomic<bool> memory_report; // Set by SIGUSR1, see schedule::handle
 		site_comm s_comm;
+		
+		// One handler per update action, indexed by the hash of its name
+		typedef void (worker::*update_handler)(std::map<std::string, std::string> &params);
+		update_action_stats update_stats[UPDATE_HASH_SIZE];
+		
+		void update_site_option(std::map<std::string, std::string> &params);
+		void update_change_passkey(std::map<std::string, std::string> &params);
+		void update_add_torrent(std::map<std::string, std::string> &params);
+		void update_update_torrent(std::map<std::string, std::string> &params);
+		void update_update_torrents(std::map<std::string, std::string> &params);
+		void update_add_token_fl(std::map<std::string, std::string> &params);
+		void update_add_token_ds(std::map<std::string, std::string> &params);
+		void update_remove_tokens(std::map<std::string, std::string> &params);
+		void update_delete_torrent(std::map<std::string, std::string> &params);
+		void update_add_user(std::map<std::string, std::string> &params);
+		void update_remove_user(std::map<std::string, std::string> &params);
+		void update_remove_users(std::map<std::string, std::string> &params);
+		void update_update_user(std::map<std::string, std::string> &params);
+		void update_set_personal_freeleech(std::map<std::string, std::string> &params);
+		void update_set_permissionid(std::map<std::string, std::string> &params);
+		void update_add_blacklist(std::map<std::string, std::string> &params);
+		void update_remove_blacklist(std::map<std::string, std::string> &params);
+		void update_edit_blacklist(std::map<std::string, std::string> &params);
+		void update_update_announce_interval(std::map<std::string, std::string> &params);
+		void update_info_torrent(std::map<std::string, std::string> &params);
 
 	public:
-		worker(site_options_t &site_options, torrent_list &torrents, user_list &users, std::vector<std::string> &_blacklist, config * conf_obj, mysql * db_obj, site_comm &sc);
-		std::string work(std::string &input, std::string &ip);
-		std::string error(std::string err);
-		std::string announce(torrent &tor, user &u, std::map<std::string, std::string> &params, std::map<std::string, std::string> &headers, std::string &ip);
-		std::string scrape(const std::list<std::string> &infohashes);
-		std::string update(std::map<std::string, std::string> &params);
+		worker(site_options_t &site_options, torrent_store &torrents, user_list &users, std::vector<std::string> &_blacklist, config * conf_obj, mysql * db_obj, site_comm &sc);
+		void work(const char *input, unsigned int input_length, uint32_t ip, std::string &output);
+		int request_shard(const char *input, unsigned int input_length);
+		void error(const char *err, std::string &output);
+		void announce(torrent_shard &shard, const infohash_t &info_hash, torrent &tor, user &u, announce_params &params, uint32_t ip, std::string &output);
+		void scrape(const std::list<std::string> &infohashes, std::string &output);
+		void update(std::map<std::string, std::string> &params, std::string &output);
+		void print_update_stats();
+		void print_memory_usage();
+		void request_memory_report() { memory_report = true; }
+		bool take_memory_report() { return memory_report.exchange(false); }
 
 		bool signal(int sig);
 
 		tracker_status get_status() { return status; }
 
-		void reap_peers();
+		unsigned int expire_peers();
+		void flush_torrents();
 };